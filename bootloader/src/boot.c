@@ -4,8 +4,11 @@
 // Needed to allow variable amount of delay.
 // #define __DELAY_BACKWARD_COMPATIBLE__
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #include "nfc.h"
+#include "unpack.h"
+#include "update.h"
 
 #define LED_PORT PORTA
 #define LED_PIN PIN2_bm
@@ -14,8 +17,8 @@
 
 #define USART0_BAUD_RATE(BAUD_RATE) ((float)(F_CPU * 64 / (16 * (float)BAUD_RATE)) + 0.5)
 
-// Constants for app locations.
-#define BOOTEND_FUSE                (0x04)
+// Constants for app locations.  Has to match FUSE_BOOTEND in the Makefile (and where the app is linked).
+#define BOOTEND_FUSE                (0x08)
 #define BOOT_SIZE                   (BOOTEND_FUSE * 0x100)
 #define MAPPED_APPLICATION_START    (MAPPED_PROGMEM_START + BOOT_SIZE)
 #define MAPPED_APPLICATION_SIZE     (MAPPED_PROGMEM_SIZE - BOOT_SIZE)
@@ -87,7 +90,7 @@ static void print(const char *str) {
 }
 
 // Fast blink the LED to indicate a bootloader error.  Device will need to be reset (via NFC) to achieve anything else.
-static void show_error() {
+static __attribute__((noreturn)) void show_error() {
     for (;;) {
         LED_PORT.OUTTGL = LED_PIN;
         _delay_ms(100);
@@ -108,13 +111,227 @@ static void uart_init() {
 static nfc_regs_t nfc;
 static uint8_t nfc_pw[8];
 
-// Help obtained from https://ww1.microchip.com/downloads/en/Appnotes/AN2634-Bootloader-for-tinyAVR-and-megaAVR-00002634C.pdf
-// Bootloader is compiled with -nostartfiles, and has no ISR table.
-// When compiling target application use -Wl,--section-start=.text=0x400 to offset code
-__attribute__((naked)) __attribute__((section(".ctors"))) void boot(void){
 
-    /* Initialize system for C support */
-    asm volatile("clr r1");
+// Firmware update over NFC (see update.h).  Pages are read from the mailbox straight into the NVM page buffer,
+// which empties the mailbox, so the phone can be putting the next page in it while this one erases and writes.
+// An empty mailbox is the ack, and the phone never has to wait for more than that.  Only the pages that changed
+// are sent: the phone works them out from the CRCs in the manifest.
+
+_Static_assert(UPDATE_APP_START == BOOT_SIZE && UPDATE_APP_END == PROGMEM_SIZE, "update.h doesn't match the part");
+_Static_assert(UPDATE_PAGE_SIZE == MAPPED_PROGMEM_PAGE_SIZE, "update.h doesn't match the part");
+
+#define update_state ((update_state_t *) (MAPPED_EEPROM_START + UPDATE_STATE_OFFSET))
+
+// Resets that might have come from the tag (its field detect pulses RESET), or from the app or UPDI wanting the
+// bootloader.  Power on, brown out and watchdog resets go straight to the app, as long as the tag has been
+// configured and no update is unfinished.
+#define BOOT_NFC_RESETS     (RSTCTRL_EXTRF_bm | RSTCTRL_SWRF_bm | RSTCTRL_UPDIRF_bm)
+
+// How long we give the phone to read our last message, and to send the next, in polls of the mailbox (about
+// 0.65ms each).
+#define UPDATE_REPLY_POLLS  (2000)
+#define UPDATE_IDLE_POLLS   (15000)
+
+// UPDATE_MANIFEST, first page, page CRCs, pending bitmap
+#define MANIFEST_CRCS       (2)
+#define MANIFEST_SIZE       (MANIFEST_CRCS + UPDATE_PAGES * 2 + UPDATE_PAGES / 8)
+
+static uint8_t manifest[MANIFEST_SIZE];
+static update_state_t next;
+static uint8_t packed[UPDATE_PACKED_MAX];
+// The page being unpacked, as the page buffer can't be read back.
+static uint8_t window[MAPPED_PROGMEM_PAGE_SIZE];
+
+// Flash and EEPROM writes share the page buffer, so the last has to finish before the next can be loaded.
+static void nvm_wait() {
+    while (NVMCTRL.STATUS & (NVMCTRL_FBUSY_bm | NVMCTRL_EEBUSY_bm)) {
+    }
+}
+
+// Only the bytes loaded into the page buffer are written (or erased), for flash and EEPROM alike.
+static void nvm_command(uint8_t command) {
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, command);
+}
+
+// Fills in the manifest, and returns the CRC of the whole image: the CRC of all its page CRCs, as they are in
+// the manifest.  That way the phone can work it out without knowing what's in the pages it isn't sending.
+static uint16_t manifest_fill() {
+    const uint8_t *data = (const uint8_t *) MAPPED_APPLICATION_START;
+    uint8_t *out = manifest;
+    *(out++) = UPDATE_MANIFEST;
+    *(out++) = UPDATE_FIRST_PAGE;
+    for (uint8_t page = 0; page < UPDATE_PAGES; page++) {
+        uint16_t crc = 0xFFFF;
+        for (uint8_t i = 0; i < MAPPED_PROGMEM_PAGE_SIZE; i++) {
+            crc = _crc_ccitt_update(crc, *(data++));
+        }
+        *(out++) = crc & 0xFF;
+        *(out++) = crc >> 8;
+    }
+    for (uint8_t i = 0; i < sizeof(update_state->pending); i++) {
+        *(out++) = update_state->state == UPDATE_RUNNING ? update_state->pending[i] : 0;
+    }
+    uint16_t image = 0xFFFF;
+    for (uint8_t *crc = manifest + MANIFEST_CRCS; crc < manifest + MANIFEST_CRCS + UPDATE_PAGES * 2; crc++) {
+        image = _crc_ccitt_update(image, *crc);
+    }
+    return image;
+}
+
+// Turning the mailbox off and on again empties it.
+static bool mailbox_reset() {
+    uint8_t ctrl = 0;
+    if (!NFC_write(NFC_NO_E2, NFC_REG_MB_CTRL_Dyn, &ctrl, 1)) {
+        return false;
+    }
+    ctrl = NFC_MB_CTRL_ENABLE_bm;
+    return NFC_write(NFC_NO_E2, NFC_REG_MB_CTRL_Dyn, &ctrl, 1);
+}
+
+// Put a message in the mailbox for the phone, and wait for it to be read.  Returns false if it isn't.
+static bool reply(uint8_t *msg, uint8_t len) {
+    if (!NFC_write(NFC_NO_E2, NFC_REG_MB_dyn, msg, len)) {
+        return false;
+    }
+    nfc_fast_transfer_mode_t ftm;
+    for (uint16_t i = 0; i < UPDATE_REPLY_POLLS; i++) {
+        if (!NFC_get_fast_mode_status(&ftm)) {
+            return false;
+        }
+        if (!(ftm.status & NFC_MB_CTRL_HOST_PUT_MSG_bm)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The phone has gone, or so has the tag.  An app that's whole can still run, but not one an update has started on.
+static bool abandon() {
+    return update_state->state == UPDATE_IDLE;
+}
+
+// Returns true to run the app: once the phone says it's done and the image checks out, or if the phone goes
+// away before starting an update.  False if it goes away part way through one.
+static bool update() {
+    uint8_t pages = 0;
+    uint16_t idle = 0;
+    for (;;) {
+        nfc_fast_transfer_mode_t ftm;
+        if (!NFC_get_fast_mode_status(&ftm)) {
+            return abandon();
+        }
+        if (!(ftm.status & NFC_MB_CTRL_RF_PUT_MSG_bm)) {
+            if (++idle == UPDATE_IDLE_POLLS) {
+                return abandon();
+            }
+            continue;
+        }
+        idle = 0;
+        uint8_t header[UPDATE_HEADER_SIZE];
+        if (ftm.len + 1 < UPDATE_HEADER_SIZE || !NFC_read(NFC_NO_E2, NFC_REG_MB_dyn, header, UPDATE_HEADER_SIZE)) {
+            header[0] = 0;
+        }
+        uint8_t page = header[1];
+        uint8_t error = 0;
+        nvm_wait();
+        if (header[0] == UPDATE_MANIFEST) {
+            if (ftm.len + 1 != UPDATE_HEADER_SIZE) {
+                error = UPDATE_BAD_MESSAGE;
+            } else {
+                manifest_fill();
+                if (!reply(manifest, sizeof(manifest))) {
+                    return abandon();
+                }
+            }
+        } else if (header[0] == UPDATE_BEGIN) {
+            if (ftm.len + 1 != UPDATE_HEADER_SIZE + UPDATE_BEGIN_SIZE ||
+                    !NFC_read(NFC_NO_E2, NFC_REG_MB_dyn + UPDATE_HEADER_SIZE, (uint8_t *) &next + UPDATE_BEGIN_OFFSET,
+                        UPDATE_BEGIN_SIZE)) {
+                error = UPDATE_BAD_MESSAGE;
+            } else {
+                // From here until it's done, the application won't be run.
+                next.tag = update_state->tag;
+                next.state = UPDATE_RUNNING;
+                for (uint8_t i = 0; i < sizeof(next); i++) {
+                    ((uint8_t *) update_state)[i] = ((uint8_t *) &next)[i];
+                }
+                nvm_command(NVMCTRL_CMD_PAGEERASEWRITE_gc);
+            }
+        } else if (header[0] == UPDATE_WRITE || header[0] == UPDATE_PACKED) {
+            uint8_t len = ftm.len + 1 - UPDATE_HEADER_SIZE;
+            bool raw = header[0] == UPDATE_WRITE;
+            if (raw ? len != MAPPED_PROGMEM_PAGE_SIZE : len > UPDATE_PACKED_MAX) {
+                error = UPDATE_BAD_MESSAGE;
+            } else if (update_state->state != UPDATE_RUNNING) {
+                error = UPDATE_NOT_STARTED;
+            } else if (page < UPDATE_FIRST_PAGE || page >= UPDATE_FIRST_PAGE + UPDATE_PAGES) {
+                // Only the application section is ours to write.
+                error = UPDATE_BAD_PAGE;
+            } else {
+                // Writes to the mapped flash go into the page buffer, so a page is read straight in.  A packed
+                // one is read out of the mailbox first, so that the phone can carry on while it's unpacked.
+                uint8_t *flash = (uint8_t *) (MAPPED_PROGMEM_START + page * MAPPED_PROGMEM_PAGE_SIZE);
+                if (!NFC_read(NFC_NO_E2, NFC_REG_MB_dyn + UPDATE_HEADER_SIZE, raw ? flash : packed, len)) {
+                    return abandon();
+                }
+                if (!raw && !update_unpack(flash, window, packed, len)) {
+                    nvm_command(NVMCTRL_CMD_PAGEBUFCLR_gc);
+                    error = UPDATE_BAD_MESSAGE;
+                } else {
+                    // The mailbox is empty again, and the phone carries on while this goes on.
+                    nvm_command(NVMCTRL_CMD_PAGEERASEWRITE_gc);
+                    pages++;
+                    // Then cross it off.  Clearing a bit doesn't need the byte erased first.
+                    page -= UPDATE_FIRST_PAGE;
+                    nvm_wait();
+                    update_state->pending[page / 8] = ~(1 << (page % 8));
+                    nvm_command(NVMCTRL_CMD_PAGEWRITE_gc);
+                }
+            }
+        } else if (header[0] == UPDATE_DONE) {
+            uint8_t left = 0;
+            for (uint8_t i = 0; i < sizeof(update_state->pending); i++) {
+                left |= update_state->pending[i];
+            }
+            if (update_state->state != UPDATE_RUNNING) {
+                error = UPDATE_NOT_STARTED;
+            } else if (left) {
+                error = UPDATE_INCOMPLETE;
+            } else if (manifest_fill() != update_state->crc) {
+                error = UPDATE_BAD_IMAGE;
+            } else {
+                // The application can run again.
+                update_state->state = UPDATE_IDLE;
+                nvm_command(NVMCTRL_CMD_PAGEERASE_gc);
+                nvm_wait();
+                // Whether or not the phone hears about it, the app is good.
+                uint8_t ack[] = { UPDATE_ACK, pages };
+                if (mailbox_reset()) {
+                    reply(ack, sizeof(ack));
+                }
+                return true;
+            }
+        } else {
+            error = UPDATE_BAD_MESSAGE;
+        }
+        if (error) {
+            uint8_t nak[] = { UPDATE_NAK, error };
+            if (!mailbox_reset() || !reply(nak, sizeof(nak))) {
+                return abandon();
+            }
+        }
+    }
+}
+
+// boot() is naked, so it has no stack frame: anything with locals lives here.  The stack pointer starts at the
+// end of RAM by itself.
+static __attribute__((noinline, noreturn)) void bootloader(void) {
+    // The app reads RSTFR too, so it's left as it is.
+    if (!(RSTCTRL.RSTFR & BOOT_NFC_RESETS) && update_state->tag == UPDATE_TAG_CONFIGURED &&
+            update_state->state == UPDATE_IDLE) {
+        goto app;
+    }
+
     uart_init();
     print("Boot");
     printHex(MAPPED_PROGMEM_PAGE_SIZE);
@@ -144,9 +361,12 @@ __attribute__((naked)) __attribute__((section(".ctors"))) void boot(void){
     if (!success) {
         goto fail;
     }
-    if (nfc.gpo != 0) {
+    // The app puts its counters in the mailbox (see src/perf.h), where they stay until a phone reads them.
+    if (nfc.gpo != 0 || nfc.mb_mode != NFC_MB_MODE_ENABLED || nfc.mb_wdg != NFC_MB_WDG_DISABLE) {
         print("Config");
         nfc.gpo = 0;
+        nfc.mb_mode = NFC_MB_MODE_ENABLED;
+        nfc.mb_wdg = NFC_MB_WDG_DISABLE;
         for (int i = 0; i < sizeof(nfc_pw); i++) {
             nfc_pw[i] = 0;
         }
@@ -163,19 +383,37 @@ __attribute__((naked)) __attribute__((section(".ctors"))) void boot(void){
     } else {
         print("Already Configured");
     }
-
-
-    // Turn off TWI
-    TWI0.MCTRLA = 0;
-
+    if (update_state->tag != UPDATE_TAG_CONFIGURED) {
+        update_state->tag = UPDATE_TAG_CONFIGURED;
+        nvm_command(NVMCTRL_CMD_PAGEERASEWRITE_gc);
+        nvm_wait();
+    }
 
 
     // By default, the tag should be configured to send out a GPIO pulse whenever a block is written to
     // its SRAM buffer.  During firmware streaming, this should be disabled and polling used, as it would reset the device.
 
-    // Check to see if there's a block for us on the NFC card
-    // If yes, go into download mode
-    // Otherwise, boot as normal.
+    // If the phone has left a message in the mailbox, it's an update.  Otherwise, boot as normal.
+    nfc_fast_transfer_mode_t ftm;
+    success = NFC_get_fast_mode_status(&ftm);
+    if (!success) {
+        goto fail;
+    }
+    if (!(ftm.status & NFC_MB_CTRL_ENABLE_bm)) {
+        uint8_t ctrl = NFC_MB_CTRL_ENABLE_bm;
+        success = NFC_write(NFC_NO_E2, NFC_REG_MB_CTRL_Dyn, &ctrl, 1);
+    }
+    // An update that didn't finish has to, before the application can run.
+    if (success && ((ftm.status & NFC_MB_CTRL_RF_PUT_MSG_bm) || update_state->state != UPDATE_IDLE)) {
+        print("Update");
+        success = update();
+    }
+    if (!success) {
+        goto fail;
+    }
+
+    // Turn off TWI
+    TWI0.MCTRLA = 0;
 
     // Jump to the "App", whatever that is - Initial flash includes a dummy one, but this bootloader may overwrite it
     print("=>App");
@@ -195,6 +433,7 @@ __attribute__((naked)) __attribute__((section(".ctors"))) void boot(void){
     LED_PORT.DIRCLR = LED_PIN;
 
 
+app:
     // Turn off ability to write to application code (Only the Bootloader can write)
     // TODO doesn't seem to work.
     NVMCTRL.CTRLB = NVMCTRL_BOOTLOCK_bm;
@@ -205,12 +444,23 @@ __attribute__((naked)) __attribute__((section(".ctors"))) void boot(void){
     __asm__ __volatile__(
         "  jmp 0x8800\n"
     );
+    __builtin_unreachable();
 
 fail:
     print("Error");
     show_error();
 }
 
+// Help obtained from https://ww1.microchip.com/downloads/en/Appnotes/AN2634-Bootloader-for-tinyAVR-and-megaAVR-00002634C.pdf
+// Bootloader is compiled with -nostartfiles, and has no ISR table.
+// When compiling target application use -Wl,--section-start=.text=0x800 (BOOT_SIZE) to offset code
+__attribute__((naked)) __attribute__((section(".ctors"))) void boot(void){
+
+    /* Initialize system for C support */
+    asm volatile("clr r1");
+    bootloader();
+}
+
 /*
 Writing to Page
 	 // Start programming at start for application section
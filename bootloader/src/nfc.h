@@ -248,7 +248,7 @@ typedef struct {
 
 #define NFC_get_dyn(addr, out) NFC_read(NFC_NO_E2, addr, out, 1)
 #define NFC_get_reg(addr, out) NFC_read(NFC_E2, addr, out, 1)
-#define NFC_get_fast_mode_status(out) NFC_read(NFC_NO_E2, NFC_MB_CTRL_Dyn, out, sizeof(nfc_fast_transfer_mode_t))
+#define NFC_get_fast_mode_status(out) NFC_read(NFC_NO_E2, NFC_REG_MB_CTRL_Dyn, out, sizeof(nfc_fast_transfer_mode_t))
 
 
 
@@ -0,0 +1,57 @@
+#ifndef __UNPACK_H__
+#define __UNPACK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "update.h"
+
+// Unpacks a page's stream (see update.h) to page, which is where it sits in the flash's memory map, so that matches
+// can reach back into the flash below it.  window gets a copy of the page as it goes, for matches within it, as
+// the page buffer can't be read back.  Returns false if the stream doesn't come to exactly a page.
+// In a header so that the host can build it too (sim/unpack.c), to check it against pack.py.
+static inline bool update_unpack(uint8_t *page, uint8_t *window, const uint8_t *in, uint8_t len) {
+    const uint8_t *end = in + len;
+    uint8_t flags = 0;
+    uint8_t i = 0;
+    for (uint8_t token = 0; i < UPDATE_PAGE_SIZE; token++) {
+        if (token % 8 == 0) {
+            if (in >= end) {
+                return false;
+            }
+            flags = *(in++);
+        }
+        // A literal is a match of one byte, from the stream.
+        uint16_t distance = 0;
+        uint8_t length = 1;
+        if (flags & 1) {
+            if (end - in < 2) {
+                return false;
+            }
+            uint16_t match = in[0] | (in[1] << 8);
+            in += 2;
+            distance = (match & UPDATE_PACK_DISTANCE_gm) + 1;
+            length = (match >> UPDATE_PACK_LENGTH_gp) + UPDATE_PACK_MIN_MATCH;
+        } else if (in >= end) {
+            return false;
+        }
+        flags >>= 1;
+        if (length > UPDATE_PAGE_SIZE - i) {
+            return false;
+        }
+        for (; length; length--, i++) {
+            uint8_t b;
+            if (!distance) {
+                b = *(in++);
+            } else if (distance <= i) {
+                b = window[i - distance];
+            } else {
+                b = page[(int16_t) i - (int16_t) distance];
+            }
+            window[i] = b;
+            page[i] = b;
+        }
+    }
+    return in == end;
+}
+
+#endif
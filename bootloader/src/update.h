@@ -0,0 +1,80 @@
+#ifndef __UPDATE_H__
+#define __UPDATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Firmware update over NFC, through the ST25DV's fast transfer mode mailbox.  See the Bootloader section of
+// README.md for how a phone drives it, and update.py for one that does.
+//
+// Messages from the phone, one per mailbox message:
+//   UPDATE_MANIFEST 0              Answered with UPDATE_MANIFEST, the first application page, the CRC of every
+//                                  application page (little endian), then update_state_t.pending.
+//   UPDATE_BEGIN 0 <crc> <pending> Starts an update that will write the pages set in the pending bitmap, and
+//                                  leave the application with the image CRC (of the page CRCs) given.
+//   UPDATE_WRITE <page> <data>     A page, numbered from the start of flash.
+//   UPDATE_PACKED <page> <stream>  A page compressed by pack.py, which may refer to the flash below it.
+//   UPDATE_DONE 0                  Answered with UPDATE_ACK and the number of pages written, if every page has
+//                                  been and the image checks out.
+// Anything wrong gets UPDATE_NAK and one of the reasons below.
+#define UPDATE_MANIFEST 'M'
+#define UPDATE_BEGIN    'B'
+#define UPDATE_WRITE    'W'
+#define UPDATE_PACKED   'Z'
+#define UPDATE_DONE     'D'
+#define UPDATE_ACK      'K'
+#define UPDATE_NAK      'N'
+
+// Reasons for a UPDATE_NAK
+#define UPDATE_BAD_MESSAGE  (1)
+#define UPDATE_BAD_PAGE     (2)
+#define UPDATE_NOT_STARTED  (3)
+#define UPDATE_INCOMPLETE   (4)
+#define UPDATE_BAD_IMAGE    (5)
+
+#define UPDATE_HEADER_SIZE  (2)
+
+// Packed pages: a flag byte for every 8 tokens, least significant bit first.  A clear bit is a literal byte, a
+// set bit a match, little endian: the distance back from the byte being unpacked (less one) in the low 12 bits,
+// and the length (less UPDATE_PACK_MIN_MATCH) in the top 4.  A page of literals is the longest a stream can be.
+#define UPDATE_PACK_MIN_MATCH   (3)
+#define UPDATE_PACK_DISTANCE_gm (0x0FFF)
+#define UPDATE_PACK_LENGTH_gp   (12)
+#define UPDATE_PACKED_MAX       (UPDATE_PAGE_SIZE / 8 + UPDATE_PAGE_SIZE)
+
+// The application's part of the flash.  Has to match FUSE_BOOTEND in bootloader/Makefile, and where the app is
+// linked; boot.c checks these against the part.
+#define UPDATE_PAGE_SIZE    (64)
+#define UPDATE_APP_START    (0x0800)
+#define UPDATE_APP_END      (0x2000)
+#define UPDATE_FIRST_PAGE   (UPDATE_APP_START / UPDATE_PAGE_SIZE)
+#define UPDATE_PAGES        ((UPDATE_APP_END - UPDATE_APP_START) / UPDATE_PAGE_SIZE)
+
+// update_state_t.state
+#define UPDATE_IDLE         (0xFF)
+#define UPDATE_RUNNING      (0x00)
+
+// update_state_t.tag, once the bootloader has configured the ST25DV (or found it configured).
+#define UPDATE_TAG_CONFIGURED   (0x5A)
+
+// Kept in the EEPROM while an update is going on, so that one that gets interrupted picks up where it left off,
+// and the application isn't run until it has finished.  Erased EEPROM reads as UPDATE_IDLE.
+typedef struct {
+    // Whether the bootloader can go straight to the app without looking at the tag.
+    uint8_t tag;
+    uint8_t state;
+    // What update_image_crc() has to come to before the application can run.
+    uint16_t crc;
+    // Pages still to be written, a bit each from UPDATE_FIRST_PAGE.  Bits are only cleared as pages are written,
+    // which doesn't need an erase.
+    uint8_t pending[UPDATE_PAGES / 8];
+} update_state_t;
+
+// What UPDATE_BEGIN carries, after its header: update_state_t from crc on.
+#define UPDATE_BEGIN_OFFSET (offsetof(update_state_t, crc))
+#define UPDATE_BEGIN_SIZE   (sizeof(update_state_t) - UPDATE_BEGIN_OFFSET)
+
+// At the very end of the EEPROM, out of the way of the app's eeprom_t.
+#define UPDATE_STATE_OFFSET (128 - sizeof(update_state_t))
+
+#endif
@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+# Compressed application images, for updates over NFC (see bootloader/src/update.h).
+#
+# Each page is compressed on its own, LZSS style, so that the bootloader can unpack it straight into the page
+# buffer with nothing but the page itself in RAM.  Matches can come from earlier in the page, or from the flash
+# below it - so from earlier pages of the new image, or ones the update isn't changing, which is where most of the
+# gain comes from with AVR code.
+#
+# A stream is groups of a flag byte and 8 tokens, least significant flag bit first.  A clear bit is a literal
+# byte; a set bit a match, two bytes little endian: 12 bits of distance back from the byte being unpacked (less
+# one), then 4 of length (less PACK_MIN_MATCH).
+#
+#   ./pack.py build/main.hex build/main.lz      Compresses an image
+#   ./pack.py --bench build/main.hex ...        Compares the bytes over the air, packed and not
+#   ./pack.py --test build/host/unpack build/main.hex ...
+#                                               Checks the bootloader's unpacker, built for the host, against ours
+#
+# An image (.lz) is a page number, a length and a stream for every page, in order.  Each page only refers to the
+# pages before it.
+
+import argparse
+import subprocess
+import sys
+
+PAGE_SIZE = 64
+PACK_MIN_MATCH = 3
+PACK_MAX_MATCH = PACK_MIN_MATCH + 15
+PACK_MAX_DISTANCE = 4096
+# Message header, and what the ST25DV adds to every mailbox write over RF (flags, command, manufacturer code,
+# length, CRC).
+HEADER_SIZE = 2
+RF_OVERHEAD = 6
+
+
+def load_hex(path):
+    """Returns {page number: bytes} for every page the image touches.  Gaps are left erased."""
+    pages = {}
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            record = bytes.fromhex(line[1:])
+            if sum(record) & 0xFF:
+                sys.exit("{}: bad checksum in {}".format(path, line))
+            length, address, kind = record[0], (record[1] << 8) | record[2], record[3]
+            data = record[4:4 + length]
+            if kind == 0x00:
+                for i, b in enumerate(data):
+                    at = base + address + i
+                    page = pages.setdefault(at // PAGE_SIZE, bytearray(b'\xff' * PAGE_SIZE))
+                    page[at % PAGE_SIZE] = b
+            elif kind == 0x02:
+                base = ((data[0] << 8) | data[1]) << 4
+            elif kind == 0x04:
+                base = ((data[0] << 8) | data[1]) << 16
+            elif kind == 0x01:
+                break
+    return {n: bytes(page) for n, page in pages.items()}
+
+
+def pack_page(flash, number, page):
+    """Compresses page number, given what the flash below it will hold when it is unpacked: {page number: bytes}
+    of the pages that are done.  Returns the stream."""
+    start = number * PAGE_SIZE
+
+    def byte(at):
+        if at >= start:
+            return page[at - start]
+        done = flash.get(at // PAGE_SIZE)
+        return None if done is None else done[at % PAGE_SIZE]
+
+    out = bytearray()
+    flags_at, flag = None, 8
+    i = 0
+    while i < PAGE_SIZE:
+        if flag == 8:
+            flags_at, flag = len(out), 0
+            out.append(0)
+        best, best_distance = 0, 0
+        limit = min(PACK_MAX_MATCH, PAGE_SIZE - i)
+        for distance in range(1, min(PACK_MAX_DISTANCE, start + i) + 1):
+            length = 0
+            while length < limit and byte(start + i + length - distance) == page[i + length]:
+                length += 1
+            if length > best:
+                best, best_distance = length, distance
+                if best == limit:
+                    break
+        if best >= PACK_MIN_MATCH:
+            out[flags_at] |= 1 << flag
+            v = (best_distance - 1) | ((best - PACK_MIN_MATCH) << 12)
+            out += bytes([v & 0xFF, v >> 8])
+            i += best
+        else:
+            out.append(page[i])
+            i += 1
+        flag += 1
+    return bytes(out)
+
+
+def unpack_page(flash, number, stream):
+    """As the bootloader does it."""
+    start = number * PAGE_SIZE
+    page = bytearray()
+    stream = iter(stream)
+    flags, flag = 0, 8
+    while len(page) < PAGE_SIZE:
+        if flag == 8:
+            flags, flag = next(stream), 0
+        if flags & (1 << flag):
+            v = next(stream) | (next(stream) << 8)
+            distance, length = (v & 0x0FFF) + 1, (v >> 12) + PACK_MIN_MATCH
+            for _ in range(length):
+                at = start + len(page) - distance
+                page.append(page[at - start] if at >= start else flash[at // PAGE_SIZE][at % PAGE_SIZE])
+        else:
+            page.append(next(stream))
+        flag += 1
+    if len(page) != PAGE_SIZE:
+        raise ValueError("page {} doesn't unpack to a page".format(number))
+    return bytes(page)
+
+
+def pack_pages(pages):
+    """Streams for every page, each unpacked after the ones before it."""
+    streams = {}
+    flash = {}
+    for number in sorted(pages):
+        streams[number] = pack_page(flash, number, pages[number])
+        flash[number] = pages[number]
+    return streams
+
+
+def pack_image(pages):
+    return b"".join(bytes([number, len(stream)]) + stream for number, stream in pack_pages(pages).items())
+
+
+def unpack_image(data):
+    flash = {}
+    at = 0
+    while at < len(data):
+        number, length = data[at], data[at + 1]
+        flash[number] = unpack_page(flash, number, data[at + 2:at + 2 + length])
+        at += 2 + length
+    return flash
+
+
+def load_image(path):
+    """Pages of a .hex or .lz image"""
+    if path.endswith(".lz"):
+        with open(path, "rb") as f:
+            return unpack_image(f.read())
+    return load_hex(path)
+
+
+def bench(paths):
+    print("{:<32} {:>6} {:>8} {:>8} {:>7}".format("image", "pages", "raw", "packed", "ratio"))
+    for path in paths:
+        pages = load_hex(path)
+        streams = pack_pages(pages)
+        if unpack_image(b"".join(bytes([n, len(s)]) + s for n, s in streams.items())) != pages:
+            sys.exit("{} doesn't survive packing".format(path))
+        # Over the air, each page is a mailbox message either way, and update.py sends whichever is smaller.
+        raw = len(pages) * (RF_OVERHEAD + HEADER_SIZE + PAGE_SIZE)
+        air = sum(RF_OVERHEAD + HEADER_SIZE + min(len(s), PAGE_SIZE) for s in streams.values())
+        print("{:<32} {:>6} {:>8} {:>8} {:>6.1f}%".format(path, len(pages), raw, air, 100.0 * air / raw))
+
+
+def run_unpacker(unpacker, packed):
+    """Pages from the bootloader's unpacker (sim/unpack.c), or None if it refused the image."""
+    result = subprocess.run([unpacker], input=packed, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    if result.returncode:
+        return None
+    out = result.stdout
+    return {out[at]: out[at + 1:at + 1 + PAGE_SIZE] for at in range(0, len(out), PAGE_SIZE + 1)}
+
+
+def test(unpacker, paths):
+    for path in paths:
+        pages = load_hex(path)
+        if run_unpacker(unpacker, pack_image(pages)) != pages:
+            sys.exit("{}: the bootloader unpacks it differently".format(path))
+        # A stream that's cut short, or runs on past the page, has to be refused.
+        number = min(pages)
+        stream = pack_page({}, number, pages[number])
+        for bad in (stream[:-1], stream + b"\0"):
+            if run_unpacker(unpacker, bytes([number, len(bad)]) + bad) is not None:
+                sys.exit("{}: the bootloader took a bad stream for page {}".format(path, number))
+        print("{}: {} pages unpack the same".format(path, len(pages)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress an application image for updates over NFC")
+    parser.add_argument("--bench", action="store_true", help="Report bytes over the air for each image")
+    parser.add_argument("--test", metavar="UNPACKER", help="Check the bootloader's unpacker on each image")
+    parser.add_argument("images", nargs="+", help="hex image, then the .lz to write")
+    args = parser.parse_args()
+    if args.bench:
+        bench(args.images)
+    elif args.test:
+        test(args.test, args.images)
+    elif len(args.images) == 2:
+        pages = load_hex(args.images[0])
+        packed = pack_image(pages)
+        if unpack_image(packed) != pages:
+            sys.exit("{} doesn't survive packing".format(args.images[0]))
+        with open(args.images[1], "wb") as f:
+            f.write(packed)
+    else:
+        parser.error("need a hex image and the .lz to write")
+
+
+if __name__ == "__main__":
+    main()
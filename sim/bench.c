@@ -0,0 +1,282 @@
+#include <libgen.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "sim.h"
+
+// Press-to-light benchmark.  Replays each press pattern through the firmware on the simulated bus, and
+// reports for every gesture (scripted press) on the first device:
+//  - latency from the finger touching the button to the first bit of the first frame that changed a light level
+//  - forward frames sent
+//  - time spent awake (running, or idle waiting on the bus)
+//  - supply charge used, from the simulator's current model
+// Results are compared against a stored baseline, and we fail if any of them got worse.
+//
+//   dalibench [-u] <firmware.so> <baseline> <pattern.txt> ...
+//
+// -u rewrites the baseline with the current results rather than checking against it.
+// Each pattern runs in its own process (which also gives each one a fresh copy of the firmware), in parallel.
+
+#define MAX_PATTERNS (32)
+#define NAME_LEN (32)
+
+// Allowed slack before a change counts as a regression.
+#define LATENCY_TOLERANCE_PCT   (5.0)
+#define LATENCY_TOLERANCE_MS    (1.0)
+#define FRAMES_TOLERANCE        (0.05)
+#define AWAKE_TOLERANCE_PCT     (5.0)
+#define AWAKE_TOLERANCE_MS      (1.0)
+#define CHARGE_TOLERANCE_PCT    (5.0)
+#define CHARGE_TOLERANCE_UC     (0.5)
+
+typedef struct {
+    char name[NAME_LEN];
+    int gestures;
+    // Gestures where no frame changed a light level.
+    int missed;
+    double p50;
+    double p90;
+    double p99;
+    double frames;
+    double awake;
+    // uC per gesture
+    double charge;
+} result_t;
+
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db;
+}
+
+// Nearest rank
+static double percentile(const double *sorted, int n, double pct) {
+    if (n == 0) {
+        return 0;
+    }
+    int rank = (int) ceil(pct / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+
+static void measure(const char *name, result_t *result) {
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, NAME_LEN, "%s", name);
+    const sim_device_t *dev = &sim.devices[0];
+    double latencies[SIM_MAX_PRESSES];
+    int num_latencies = 0;
+    uint32_t frames = 0;
+    sim_time_t awake = 0;
+    double charge = 0;
+
+    for (int g = 0; g < dev->num_gestures; g++) {
+        sim_time_t start = dev->gestures[g];
+        sim_time_t end = sim_gesture_end(dev, g);
+        bool found = false;
+        for (int i = 0; i < sim.num_tx; i++) {
+            const sim_tx_t *tx = &sim.tx[i];
+            if (tx->sender != dev->id || tx->backward || tx->brk || tx->start < start || tx->start >= end) {
+                continue;
+            }
+            frames++;
+            if (!found && tx->changed_level) {
+                latencies[num_latencies++] = (tx->start - start) / 1e6;
+                found = true;
+            }
+        }
+        if (!found) {
+            result->missed++;
+        }
+        awake += sim_gesture_awake(dev, g);
+        charge += sim_gesture_charge(dev, g);
+    }
+    qsort(latencies, num_latencies, sizeof(double), compare_double);
+    result->gestures = dev->num_gestures;
+    result->p50 = percentile(latencies, num_latencies, 50);
+    result->p90 = percentile(latencies, num_latencies, 90);
+    result->p99 = percentile(latencies, num_latencies, 99);
+    if (dev->num_gestures) {
+        result->frames = (double) frames / dev->num_gestures;
+        result->awake = awake / 1e6 / dev->num_gestures;
+        result->charge = charge / dev->num_gestures;
+    }
+}
+
+
+static void pattern_name(const char *path, char *name) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", path);
+    snprintf(name, NAME_LEN, "%s", basename(buf));
+    char *dot = strrchr(name, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+}
+
+
+// Run one pattern in a child process, which sends the result back down a pipe.
+static pid_t start_pattern(const char *firmware, const char *path, int *fd) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        result_t result;
+        char name[NAME_LEN];
+        pattern_name(path, name);
+        sim_reset();
+        if (!script_load(path)) {
+            exit(1);
+        }
+        sim_run(firmware);
+        measure(name, &result);
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+            exit(1);
+        }
+        exit(0);
+    }
+    close(fds[1]);
+    *fd = fds[0];
+    return pid;
+}
+
+
+static int load_baseline(const char *path, result_t *baseline) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char line[256];
+    int n = 0;
+    while (n < MAX_PATTERNS && fgets(line, sizeof(line), f)) {
+        result_t *r = &baseline[n];
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%31s %d %d %lf %lf %lf %lf %lf %lf", r->name, &r->gestures, &r->missed,
+                   &r->p50, &r->p90, &r->p99, &r->frames, &r->awake, &r->charge) == 9) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static void save_baseline(const char *path, const result_t *results, int n) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(f, "# pattern gestures missed p50_ms p90_ms p99_ms frames_per_gesture awake_ms_per_gesture uC_per_gesture\n");
+    for (int i = 0; i < n; i++) {
+        const result_t *r = &results[i];
+        fprintf(f, "%s %d %d %.3f %.3f %.3f %.3f %.3f %.3f\n", r->name, r->gestures, r->missed,
+                r->p50, r->p90, r->p99, r->frames, r->awake, r->charge);
+    }
+    fclose(f);
+}
+
+
+static bool worse(const char *what, const char *name, double now, double then, double pct, double abs) {
+    double limit = then + fmax(then * pct / 100.0, abs);
+    if (now > limit) {
+        printf("REGRESSION %s %s: %.3f, baseline %.3f\n", name, what, now, then);
+        return true;
+    }
+    return false;
+}
+
+static bool check(const result_t *r, const result_t *base) {
+    bool bad = false;
+    if (r->missed > base->missed) {
+        printf("REGRESSION %s: %d gestures didn't change the light, baseline %d\n", r->name, r->missed, base->missed);
+        bad = true;
+    }
+    bad |= worse("p50 latency", r->name, r->p50, base->p50, LATENCY_TOLERANCE_PCT, LATENCY_TOLERANCE_MS);
+    bad |= worse("p90 latency", r->name, r->p90, base->p90, LATENCY_TOLERANCE_PCT, LATENCY_TOLERANCE_MS);
+    bad |= worse("p99 latency", r->name, r->p99, base->p99, LATENCY_TOLERANCE_PCT, LATENCY_TOLERANCE_MS);
+    bad |= worse("frames per gesture", r->name, r->frames, base->frames, 0, FRAMES_TOLERANCE);
+    bad |= worse("awake per gesture", r->name, r->awake, base->awake, AWAKE_TOLERANCE_PCT, AWAKE_TOLERANCE_MS);
+    bad |= worse("charge per gesture", r->name, r->charge, base->charge, CHARGE_TOLERANCE_PCT, CHARGE_TOLERANCE_UC);
+    return bad;
+}
+
+
+int main(int argc, char **argv) {
+    bool update = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "u")) != -1) {
+        switch (opt) {
+            case 'u':
+                update = true;
+                break;
+            default:
+                return 2;
+        }
+    }
+    int npatterns = argc - optind - 2;
+    if (npatterns < 1 || npatterns > MAX_PATTERNS) {
+        fprintf(stderr, "usage: %s [-u] <firmware.so> <baseline> <pattern.txt> ...\n", argv[0]);
+        return 2;
+    }
+    const char *firmware = argv[optind];
+    const char *baseline_path = argv[optind + 1];
+    char **patterns = argv + optind + 2;
+
+    pid_t pids[MAX_PATTERNS];
+    int fds[MAX_PATTERNS];
+    result_t results[MAX_PATTERNS];
+    for (int i = 0; i < npatterns; i++) {
+        pids[i] = start_pattern(firmware, patterns[i], &fds[i]);
+    }
+    bool failed = false;
+    for (int i = 0; i < npatterns; i++) {
+        int status;
+        ssize_t n = read(fds[i], &results[i], sizeof(result_t));
+        close(fds[i]);
+        waitpid(pids[i], &status, 0);
+        if (n != sizeof(result_t) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s failed\n", patterns[i]);
+            return 1;
+        }
+    }
+
+    printf("%-12s %8s %6s %9s %9s %9s %9s %12s %9s\n", "pattern", "gestures", "missed", "p50 ms", "p90 ms", "p99 ms", "frames/g", "awake ms/g", "uC/g");
+    for (int i = 0; i < npatterns; i++) {
+        const result_t *r = &results[i];
+        printf("%-12s %8d %6d %9.2f %9.2f %9.2f %9.2f %12.2f %9.2f\n", r->name, r->gestures, r->missed,
+               r->p50, r->p90, r->p99, r->frames, r->awake, r->charge);
+    }
+
+    if (update) {
+        save_baseline(baseline_path, results, npatterns);
+        printf("Baseline written to %s\n", baseline_path);
+        return 0;
+    }
+
+    result_t baseline[MAX_PATTERNS];
+    int nbaseline = load_baseline(baseline_path, baseline);
+    for (int i = 0; i < npatterns; i++) {
+        const result_t *base = NULL;
+        for (int j = 0; j < nbaseline; j++) {
+            if (strcmp(baseline[j].name, results[i].name) == 0) {
+                base = &baseline[j];
+            }
+        }
+        if (base == NULL) {
+            printf("%s has no baseline\n", results[i].name);
+            failed = true;
+        } else {
+            failed |= check(&results[i], base);
+        }
+    }
+    printf(failed ? "FAIL\n" : "PASS\n");
+    return failed ? 1 : 0;
+}
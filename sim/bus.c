@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "hal.h"
+#include "sim.h"
+
+// The virtual DALI bus, plus the device side PHY that drives it.
+//
+// Rather than sampling, the bus is kept as the list of Manchester frames that each sender put on it.
+// The line is pulled low if any sender is pulling it low, so overlapping frames interfere the same way
+// they do on a real bus.
+
+// Frames can be registered slightly out of order (gear replies are scheduled into the future), so when
+// looking for frames that overlap a time we keep scanning back until we're this far before it.
+#define SCAN_WINDOW_NS      (100 * SIM_NS_PER_MS)
+
+// Edges phy_receive() keeps track of.
+#define SIM_MAX_RX_EDGES    (128)
+// How often phy_wait() looks at the bus while listening.
+#define SIM_LISTEN_STEP_NS  (10 * SIM_NS_PER_US)
+
+
+sim_time_t frame_duration(uint8_t nbits) {
+    return nbits * 2 * SIM_HALF_BIT_NS;
+}
+
+
+sim_tx_t *bus_transmit(int sender, bool backward, sim_time_t start, uint32_t frame, uint8_t nbits) {
+    if (sim.num_tx >= sim.max_tx) {
+        sim.max_tx = sim.max_tx ? sim.max_tx * 2 : 1024;
+        sim.tx = realloc(sim.tx, sim.max_tx * sizeof(sim_tx_t));
+    }
+    sim_tx_t *tx = &sim.tx[sim.num_tx++];
+    memset(tx, 0, sizeof(*tx));
+    tx->sender = sender;
+    tx->backward = backward;
+    tx->start = start;
+    tx->end = start + frame_duration(nbits);
+    tx->frame = frame;
+    tx->nbits = nbits;
+    // Gear doesn't act on backward frames.
+    tx->processed = backward;
+    return tx;
+}
+
+
+// true if this frame has the line pulled low at time t
+static bool tx_low(const sim_tx_t *tx, sim_time_t t) {
+    if (t < tx->start || t >= tx->end) {
+        return false;
+    }
+    if (tx->brk) {
+        return true;
+    }
+    uint64_t half = (t - tx->start) / SIM_HALF_BIT_NS;
+    if (half >= tx->nbits * 2) {
+        return false;
+    }
+    bool bit = (tx->frame << (half / 2)) & 0x80000000UL;
+    // A one is low for the first half of the bit, then high.
+    return (half & 1) ? !bit : bit;
+}
+
+
+bool bus_level(sim_time_t t) {
+    for (int i = sim.num_tx - 1; i >= 0; i--) {
+        const sim_tx_t *tx = &sim.tx[i];
+        if (tx->start + SCAN_WINDOW_NS < t) {
+            break;
+        }
+        if (tx_low(tx, t)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static int compare_time(const void *a, const void *b) {
+    sim_time_t ta = *(const sim_time_t *) a, tb = *(const sim_time_t *) b;
+    return ta < tb ? -1 : ta > tb;
+}
+
+
+// Transitions of the combined bus level in (from, to].  Returns how many there were, even if more than max.
+int bus_edges(sim_time_t from, sim_time_t to, sim_time_t *edges, int max) {
+    // Every transition happens on a half bit boundary of one of the frames on the bus, or when a frame is cut short.
+    static sim_time_t *candidates;
+    static int max_candidates;
+    int n = 0;
+    for (int i = sim.num_tx - 1; i >= 0; i--) {
+        const sim_tx_t *tx = &sim.tx[i];
+        if (tx->start + SCAN_WINDOW_NS < from) {
+            break;
+        }
+        if (tx->end <= from || tx->start > to) {
+            continue;
+        }
+        int halves = tx->nbits * 2;
+        if (n + halves + 2 > max_candidates) {
+            max_candidates = (n + halves + 2) * 2;
+            candidates = realloc(candidates, max_candidates * sizeof(sim_time_t));
+        }
+        for (int h = 0; h <= halves; h++) {
+            candidates[n++] = tx->start + h * SIM_HALF_BIT_NS;
+        }
+        candidates[n++] = tx->end;
+    }
+    qsort(candidates, n, sizeof(sim_time_t), compare_time);
+
+    int count = 0;
+    bool level = bus_level(from);
+    for (int i = 0; i < n; i++) {
+        sim_time_t t = candidates[i];
+        if (t <= from || t > to || (i > 0 && t == candidates[i-1])) {
+            continue;
+        }
+        bool now = bus_level(t);
+        if (now != level) {
+            if (count < max) {
+                edges[count] = t;
+            }
+            count++;
+            level = now;
+        }
+    }
+    return count;
+}
+
+
+static bool overlaps(const sim_tx_t *a, const sim_tx_t *b) {
+    return a->start < b->end && b->start < a->end;
+}
+
+// true if some other frame was on the bus at the same time as this one.
+static bool interfered(const sim_tx_t *tx) {
+    for (int i = 0; i < sim.num_tx; i++) {
+        const sim_tx_t *other = &sim.tx[i];
+        if (other != tx && overlaps(tx, other)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// End time of the earliest forward frame the gear hasn't yet acted on.
+sim_time_t bus_pending(void) {
+    sim_time_t earliest = SIM_NEVER;
+    for (int i = sim.first_unprocessed; i < sim.num_tx; i++) {
+        const sim_tx_t *tx = &sim.tx[i];
+        if (!tx->processed && tx->end < earliest) {
+            earliest = tx->end;
+        }
+    }
+    return earliest;
+}
+
+
+static inline uint32_t encode_backward_frame(uint8_t val) {
+    return ((uint32_t) (0x100 | val)) << (32 - 9);
+}
+
+
+// Let the gear see every forward frame that has finished by upto.  By the time we are called every
+// device has got at least this far, so anything that could have interfered with the frame is known.
+void bus_process(sim_time_t upto) {
+    for (int i = sim.first_unprocessed; i < sim.num_tx; i++) {
+        sim_tx_t *tx = &sim.tx[i];
+        if (tx->processed || tx->end > upto) {
+            continue;
+        }
+        tx->processed = true;
+        uint8_t addr = tx->frame >> 23;
+        uint8_t cmd = tx->frame >> 15;
+        if (interfered(tx)) {
+            if (sim.trace) {
+                printf("%10.3f ms  dev%-3d %02x %02x  collision\n", tx->start / 1e6, tx->sender, addr, cmd);
+            }
+            continue;
+        }
+        if (tx->nbits == 25) {
+            // An input device event.  There's no application controller to act on it, so it's only traced.
+            tx->delivered = true;
+            if (sim.trace) {
+                printf("%10.3f ms  dev%-3d %02x %02x %02x  event\n", tx->start / 1e6, tx->sender, addr, cmd, (uint8_t) (tx->frame >> 7));
+            }
+            continue;
+        }
+        if (tx->nbits != 17) {
+            continue;
+        }
+        tx->delivered = true;
+        if (sim.trace) {
+            printf("%10.3f ms  dev%-3d %02x %02x\n", tx->start / 1e6, tx->sender, addr, cmd);
+        }
+        for (int g = 0; g < sim.num_gear; g++) {
+            uint8_t reply;
+            bool changed = false;
+            if (gear_forward_frame(&sim.gear[g], addr, cmd, &reply, &changed)) {
+                sim_time_t start = tx->end + sim.gear[g].reply_delay;
+                bus_transmit(-1 - g, true, start, encode_backward_frame(reply), 9);
+                // Adding a frame may have moved the list.
+                tx = &sim.tx[i];
+                if (sim.trace) {
+                    printf("%10.3f ms  gear%-2d %02x\n", start / 1e6, sim.gear[g].addr, reply);
+                }
+            }
+            tx->changed_level |= changed;
+        }
+    }
+    while (sim.first_unprocessed < sim.num_tx && sim.tx[sim.first_unprocessed].processed) {
+        sim.first_unprocessed++;
+    }
+}
+
+
+// ------------------------ PHY -------------------------------
+
+static inline uint16_t ns_to_ticks(sim_time_t t) {
+    return (uint16_t) (uint64_t) (t * (F_CPU / 1e9));
+}
+
+
+// Whether a forward frame starting now leaves at least the shortest DALI-2 settling time after whatever was
+// on the bus before it.  The firmware decides which settling time applies, so we can only check the minimum.
+static bool settled(sim_time_t start) {
+    for (int i = sim.num_tx - 1; i >= 0; i--) {
+        const sim_tx_t *tx = &sim.tx[i];
+        if (tx->start + SCAN_WINDOW_NS < start) {
+            break;
+        }
+        if (tx->start >= start) {
+            continue;
+        }
+        sim_time_t settling = (tx->backward ? DALI_SETTLING_BACKWARD_USEC : DALI_SETTLING_PRIORITY1_USEC) * SIM_NS_PER_US;
+        if (start < tx->end + settling) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// The comparator has to be on, and have had time to start up, before the PHY can see the bus.
+void bus_check_phy_powered(sim_device_t *dev) {
+    if (!dev->phy_powered || dev->now < dev->phy_powered_at + SIM_PHY_POWER_UP_NS) {
+        dev->phy_violations++;
+        if (sim.trace) {
+            printf("%10.3f ms  dev%-3d used the PHY before the comparator was up\n", dev->now / 1e6, dev->id);
+        }
+    }
+}
+
+
+bool phy_power_up() {
+    sim_device_t *dev = sim_current;
+    if (dev->phy_powered) {
+        return false;
+    }
+    dev->phy_powered = true;
+    dev->phy_powered_at = dev->now;
+    return true;
+}
+
+
+// The PHY clock is kept in real time here, so there's nothing to carry over.
+void phy_sleep() {
+    sim_current->phy_powered = false;
+}
+
+void phy_wake() {
+}
+
+
+// A frame starting at this very moment can't have reached the comparator yet, so two devices that go at the same
+// time both see the bus idle, and collide.
+bool phy_bus_idle() {
+    bus_check_phy_powered(sim_current);
+    return bus_level(sim_current->now - 1);
+}
+
+
+// Same as the hardware, on the slow clock with an interrupt per half bit, reading the bus back at the end of each
+// one.  The frame goes on the bus up front, and is cut short if it collides.  It's kept by index, as other devices
+// adding frames while we wait can move the list.
+bool phy_transmit(uint32_t frame, uint8_t nbits) {
+    sim_device_t *dev = sim_current;
+    bus_check_phy_powered(dev);
+    if (!settled(dev->now)) {
+        dev->settling_violations++;
+        if (sim.trace) {
+            printf("%10.3f ms  dev%-3d sent before the bus had settled\n", dev->now / 1e6, dev->id);
+        }
+    }
+    const sim_time_t start = dev->now;
+    int index = sim.num_tx;
+    sim_time_t end = bus_transmit(dev->id, false, start, frame, nbits)->end;
+    dev->frames_sent++;
+    sim_set_clock(dev, CLOCK_HZ(CLOCK_SLOW_DIV));
+    sim_advance((sim_time_t) (nbits * 2 * SIM_CYCLES_PER_CALL * 1e9 / dev->clock_hz), POWER_RUN);
+    bool collided = false;
+    for (int h = 1; h <= nbits * 2 && !collided; h++) {
+        sim_time_t t = start + h * SIM_HALF_BIT_NS;
+        sim_wait_until(t, POWER_IDLE);
+        collided = !tx_low(&sim.tx[index], t - 1) && !bus_level(t - 1);
+    }
+    if (collided) {
+        sim.tx[index].end = dev->now;
+        sim_tx_t *brk = bus_transmit(dev->id, false, dev->now, 0, 0);
+        brk->brk = true;
+        brk->processed = true;
+        brk->end = dev->now + DALI_BREAK_USEC * SIM_NS_PER_US;
+        end = brk->end;
+        dev->collisions++;
+        if (sim.trace) {
+            printf("%10.3f ms  dev%-3d collided\n", dev->now / 1e6, dev->id);
+        }
+    }
+    sim_wait_until(end, POWER_IDLE);
+    sim_set_clock(dev, CLOCK_HZ(CLOCK_FAST_DIV));
+    dev->frame_end = end;
+    return !collided;
+}
+
+
+uint16_t phy_since_frame_end() {
+    sim_device_t *dev = sim_current;
+    if (dev->frame_end == SIM_NEVER || dev->now - dev->frame_end >= PHY_CLOCK_MAX_USEC * SIM_NS_PER_US) {
+        return 0xFFFF;
+    }
+    return (dev->now - dev->frame_end) * (F_CPU / 1e9) / PHY_CLOCK_DIV;
+}
+
+
+// Listening is done in small steps, standing in for the comparator interrupt, so we notice the bus change up to a
+// step late.
+bool phy_wait(uint16_t ticks, bool listen) {
+    sim_device_t *dev = sim_current;
+    const sim_time_t start = dev->now;
+    const sim_time_t end = start + (sim_time_t) (ticks * PHY_CLOCK_DIV * (1e9 / F_CPU));
+    bool quiet = true;
+    sim_set_clock(dev, CLOCK_HZ(CLOCK_SLOW_DIV));
+    if (listen) {
+        bus_check_phy_powered(dev);
+        while (quiet && dev->now < end) {
+            sim_time_t step = dev->now + SIM_LISTEN_STEP_NS;
+            sim_wait_until(step < end ? step : end, POWER_IDLE);
+            quiet = bus_edges(start, dev->now, NULL, 0) == 0;
+        }
+    } else {
+        sim_wait_until(end, POWER_IDLE);
+    }
+    sim_set_clock(dev, CLOCK_HZ(CLOCK_FAST_DIV));
+    return quiet;
+}
+
+
+// Same as the hardware: wait up to timeout for the first falling edge, then keep capturing until
+// the line has been quiet for 2 bit periods.  We step in half bits so that everybody else on the bus
+// has had a chance to start transmitting before we look.
+uint8_t phy_receive(uint16_t timeout, uint16_t *edges) {
+    sim_device_t *dev = sim_current;
+    bus_check_phy_powered(dev);
+    const sim_time_t start = dev->now;
+    const sim_time_t quiet = 4 * SIM_HALF_BIT_NS;
+    sim_time_t deadline = start + (sim_time_t) (timeout * (1e9 / F_CPU));
+    // Far more than a backward frame, so that we can follow a forward frame (or a collision) to its last edge,
+    // as the hardware does.
+    sim_time_t times[SIM_MAX_RX_EDGES];
+    int count = 0;
+    int stored = 0;
+
+    for (;;) {
+        sim_time_t step = dev->now + SIM_HALF_BIT_NS;
+        sim_wait_until(step < deadline ? step : deadline, POWER_IDLE);
+        count = bus_edges(start, dev->now, times, SIM_MAX_RX_EDGES);
+        stored = count > SIM_MAX_RX_EDGES ? SIM_MAX_RX_EDGES : count;
+        // Capture starts on a falling edge.  If the line was low when we started, ignore the rising edge.
+        if (stored > 0 && !bus_level(start)) {
+            memmove(times, times + 1, (stored - 1) * sizeof(sim_time_t));
+            stored--;
+            count--;
+        }
+        if (stored > 0) {
+            deadline = times[stored - 1] + quiet;
+        }
+        if (dev->now >= deadline) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < count && i < PHY_MAX_EDGES; i++) {
+        edges[i] = ns_to_ticks(times[i]);
+    }
+    // As the hardware, the PHY clock starts at the last edge, or if there wasn't one, when we started listening.
+    dev->frame_end = stored > 0 ? times[stored - 1] : start;
+    return count > PHY_MAX_EDGES ? PHY_MAX_EDGES + 1 : count;
+}
@@ -0,0 +1,85 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cmd.h"
+#include "perf.h"
+#include "sim.h"
+
+// Runs a scenario script against the firmware, printing the bus traffic and a summary per device.
+//
+//   dalisim [-q] <firmware.so> <scenario>
+
+
+static void report(void) {
+    printf("\n");
+    for (int i = 0; i < sim.num_devices; i++) {
+        const sim_device_t *dev = &sim.devices[i];
+        sim_time_t total = dev->power[POWER_RUN] + dev->power[POWER_IDLE] + dev->power[POWER_STANDBY] + dev->power[POWER_DOWN];
+        printf("dev%-3d frames %-4u wakeups %-4u run %9.3f ms  idle %9.3f ms  standby %10.3f ms  sleep %10.3f ms  awake %6.3f%%",
+            dev->id, dev->frames_sent, dev->wakeups,
+            dev->power[POWER_RUN] / 1e6, dev->power[POWER_IDLE] / 1e6, dev->power[POWER_STANDBY] / 1e6, dev->power[POWER_DOWN] / 1e6,
+            total ? 100.0 * (dev->power[POWER_RUN] + dev->power[POWER_IDLE]) / total : 0.0);
+        if (dev->watchdog_resets) {
+            printf("  WATCHDOG x%u", dev->watchdog_resets);
+        }
+        if (dev->eeprom_writes) {
+            printf("  eeprom writes %u", dev->eeprom_writes);
+        }
+        if (dev->settling_violations) {
+            printf("  UNSETTLED x%u", dev->settling_violations);
+        }
+        if (dev->phy_violations) {
+            printf("  PHY OFF x%u", dev->phy_violations);
+        }
+        // The firmware's own count of how it got on sharing the bus.
+        const perf_t *perf = dlsym(dev->so, "perf");
+        const dali_stats_t *stats = perf ? &perf->dali : NULL;
+        if (stats && (stats->collisions || stats->deferrals)) {
+            printf("  collisions %u retries %u dropped %u deferrals %u", stats->collisions, stats->retries, stats->dropped, stats->deferrals);
+        }
+        if (dev->mailbox_writes) {
+            printf("  mailbox writes %u", dev->mailbox_writes);
+        }
+        printf("\n%-6s average current %.2f uA\n", "", sim_average_current(dev));
+        // And its lifetime counters, as a phone would read them.
+        if (perf) {
+            printf("%-6s wakeups pin %u rtc %u reset %u  awake %u sleep %u ticks  replies %u nak %u collision %u manchester %u\n", "",
+                perf->wakeups[PERF_WAKE_PIN], perf->wakeups[PERF_WAKE_RTC], perf->wakeups[PERF_WAKE_RESET],
+                perf->awake_ticks, perf->sleep_ticks, stats->replies[READ_VALUE], stats->replies[READ_NAK],
+                stats->replies[READ_COLLISION], stats->replies[READ_MANCHESTER_ERROR]);
+        }
+    }
+    for (int i = 0; i < sim.num_gear; i++) {
+        const sim_gear_t *gear = &sim.gear[i];
+        printf("gear%-2d level %-3u frames %-4u replies %-4u level changes %u\n",
+            gear->addr, gear->level, gear->frames_seen, gear->replies, gear->level_changes);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    sim_reset();
+    sim.trace = true;
+    while ((opt = getopt(argc, argv, "q")) != -1) {
+        switch (opt) {
+            case 'q':
+                sim.trace = false;
+                break;
+            default:
+                return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-q] <firmware.so> <scenario>\n", argv[0]);
+        return 2;
+    }
+    if (!script_load(argv[optind + 1])) {
+        return 1;
+    }
+    sim_run(argv[optind]);
+    report();
+    return 0;
+}
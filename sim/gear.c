@@ -0,0 +1,196 @@
+#include <math.h>
+#include <string.h>
+#include "cmd.h"
+#include "sim.h"
+
+// A simple model of IEC 62386-102 control gear.  It covers the commands and queries the switch uses,
+// plus enough of the configuration commands to script a commissioning.  Fades are instantaneous.
+
+#define MASK (0xFF)
+
+
+sim_gear_t *gear_add(int addr) {
+    if (sim.num_gear >= SIM_MAX_GEAR) {
+        return NULL;
+    }
+    sim_gear_t *gear = &sim.gear[sim.num_gear++];
+    memset(gear, 0, sizeof(*gear));
+    gear->addr = addr;
+    gear->level = 0;
+    gear->last_active = 254;
+    gear->min = 1;
+    gear->max = 254;
+    gear->phys_min = 1;
+    gear->fade_rate = 7;
+    gear->reply_delay = 5500 * SIM_NS_PER_US;
+    return gear;
+}
+
+
+static bool addressed(const sim_gear_t *gear, uint8_t addr) {
+    if ((addr & 0xFC) == 0xFC) {
+        // Broadcast, or broadcast unaddressed.
+        return true;
+    }
+    if ((addr & 0x80) == 0) {
+        return gear->addr == (addr >> 1);
+    }
+    if ((addr & 0xE0) == 0x80) {
+        return gear->groups & (1 << ((addr >> 1) & 0x0F));
+    }
+    return false;
+}
+
+
+static void set_level(sim_gear_t *gear, int level) {
+    if (level > 0) {
+        if (level < gear->min) {
+            level = gear->min;
+        }
+        if (level > gear->max) {
+            level = gear->max;
+        }
+        gear->last_active = level;
+    }
+    gear->level = level;
+}
+
+
+// Number of steps an UP or DOWN moves in its 200ms, at the configured fade rate.
+static int fade_steps(const sim_gear_t *gear) {
+    int steps = (int) (357.796 / pow(M_SQRT2, gear->fade_rate - 1) * 0.2 + 0.5);
+    return steps ? steps : 1;
+}
+
+
+// Returns true (and sets *reply) if the gear answers.  *changed is set if the light level moved.
+bool gear_forward_frame(sim_gear_t *gear, uint8_t addr, uint8_t cmd, uint8_t *reply, bool *changed) {
+    if (addr == 0xA3) {
+        // DTR0
+        gear->dtr0 = cmd;
+        return false;
+    }
+    if (!addressed(gear, addr)) {
+        return false;
+    }
+    gear->frames_seen++;
+    uint8_t before = gear->level;
+    bool answer = false;
+
+    if ((addr & 0x01) == 0) {
+        // Direct arc power
+        if (cmd != MASK) {
+            set_level(gear, cmd);
+        }
+    } else {
+        switch (cmd) {
+            case DALI_CMD_OFF:
+                set_level(gear, 0);
+                break;
+            case DALI_CMD_UP:
+                if (gear->level) {
+                    set_level(gear, gear->level + fade_steps(gear));
+                }
+                break;
+            case DALI_CMD_DOWN:
+                if (gear->level) {
+                    set_level(gear, gear->level > fade_steps(gear) ? gear->level - fade_steps(gear) : gear->min);
+                }
+                break;
+            case DALI_CMD_STEP_UP:
+                if (gear->level) {
+                    set_level(gear, gear->level + 1);
+                }
+                break;
+            case DALI_CMD_STEP_DOWN:
+                if (gear->level) {
+                    set_level(gear, gear->level - 1 ? gear->level - 1 : 1);
+                }
+                break;
+            case DALI_CMD_RECALL_MAX_LEVEL:
+                set_level(gear, gear->max);
+                break;
+            case DALI_CMD_RECALL_MIN_LEVEL:
+                set_level(gear, gear->min);
+                break;
+            case DALI_CMD_STEP_DOWN_AND_OFF:
+                set_level(gear, gear->level <= gear->min ? 0 : gear->level - 1);
+                break;
+            case DALI_CMD_ON_AND_STEP_UP:
+                set_level(gear, gear->level ? gear->level + 1 : gear->min);
+                break;
+            case DALI_CMD_GO_TO_LAST_ACTIVE_LEVEL:
+                set_level(gear, gear->last_active);
+                break;
+            case DALI_CMD_SET_MAX_LEVEL:
+                gear->max = gear->dtr0;
+                break;
+            case DALI_CMD_SET_MIN_LEVEL:
+                gear->min = gear->dtr0 < gear->phys_min ? gear->phys_min : gear->dtr0;
+                break;
+            case DALI_CMD_SET_FADE_RATE:
+                gear->fade_rate = gear->dtr0;
+                break;
+            case DALI_CMD_QUERY_STATUS:
+                *reply = gear->level ? 0x04 : 0x00;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_CONTROL_GEAR_PRESENT:
+                *reply = 0xFF;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_LAMP_POWER_ON:
+                // Yes/No queries answer yes, or not at all.
+                *reply = 0xFF;
+                answer = gear->level != 0;
+                break;
+            case DALI_CMD_QUERY_CONTENT_DTR0:
+                *reply = gear->dtr0;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_PHYSICAL_MINIMUM:
+                *reply = gear->phys_min;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_ACTUAL_LEVEL:
+                *reply = gear->level;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_MAX_LEVEL:
+                *reply = gear->max;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_MIN_LEVEL:
+                *reply = gear->min;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_FADE_TIME_FADE_RATE:
+                *reply = gear->fade_rate & 0x0F;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_GROUPS_ZERO_TO_SEVEN:
+                *reply = gear->groups;
+                answer = true;
+                break;
+            case DALI_CMD_QUERY_GROUPS_EIGHT_TO_FIFTEEN:
+                *reply = gear->groups >> 8;
+                answer = true;
+                break;
+            default:
+                if ((cmd & 0xF0) == DALI_CMD_ADD_TO_GROUP) {
+                    gear->groups |= 1 << (cmd & 0x0F);
+                } else if ((cmd & 0xF0) == DALI_CMD_REMOVE_FROM_GROUP) {
+                    gear->groups &= ~(1 << (cmd & 0x0F));
+                }
+                break;
+        }
+    }
+    if (gear->level != before) {
+        gear->level_changes++;
+        *changed = true;
+    }
+    if (answer) {
+        gear->replies++;
+    }
+    return answer;
+}
@@ -0,0 +1,73 @@
+#ifndef __HAL_SIM_H__
+#define __HAL_SIM_H__
+
+// Host implementation of the HAL in src/hal.h.  Rather than registers, these talk to the simulated
+// peripherals in sim.c, on behalf of whichever simulated device is currently running.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIN0_bm 0x01
+#define PIN1_bm 0x02
+#define PIN2_bm 0x04
+#define PIN3_bm 0x08
+#define PIN4_bm 0x10
+#define PIN5_bm 0x20
+#define PIN6_bm 0x40
+#define PIN7_bm 0x80
+
+#define SWITCH_SENSE_NONE   (0)
+#define SWITCH_SENSE_CHANGE (1)
+#define SWITCH_SENSE_WAKE   (2)
+
+#define SLEEP_DEEP          (0)
+#define SLEEP_TIMED         (1)
+
+// Every device starts from power on, and the watchdog doesn't reset it.
+#define HAL_RESET_WATCHDOG  (0x08)
+#define HAL_RESET_EXTERNAL  (0x02)
+
+// Interrupt handlers become plain functions, which the simulator looks up by name and calls.
+#define ISR(vector) void vector(void)
+#define sei() sim_interrupts(true)
+#define cli() sim_interrupts(false)
+#define wdt_reset() hal_wdt_reset()
+// Same as avr-libc's, for the one type we use.  Interrupts only come in at HAL calls, so it's those it keeps out.
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (bool sim_irq_was = sim_interrupts_off(), sim_irq_once = true; sim_irq_once; \
+                                sim_interrupts(sim_irq_was), sim_irq_once = false)
+#define _delay_us(us) sim_delay_us(us)
+#define _delay_ms(ms) sim_delay_us((ms) * 1000.0)
+
+// The user row and EEPROM are per device, so are looked up through the current device.
+#define USERROW (*sim_userrow())
+#define hal_eeprom (sim_eeprom())
+
+uint16_t hal_rtc_now(void);
+uint8_t hal_switch_read(void);
+void hal_switch_init(uint8_t mask);
+void hal_switch_sense(uint8_t mask, uint8_t sense);
+uint8_t hal_switch_pending(void);
+void hal_switch_ack(uint8_t mask);
+#define HAL_SAMPLE_TICKS (2)
+void hal_sample_timer(bool on);
+void hal_rtc_alarm(uint16_t at);
+void hal_rtc_alarm_off(void);
+void hal_sleep(uint8_t mode);
+void hal_reset(void);
+void hal_wdt_reset(void);
+void hal_wdt_enable(bool enable);
+void hal_eeprom_write(uint8_t offset, const void *data, uint8_t len);
+uint16_t hal_seed(void);
+uint8_t hal_reset_cause(void);
+bool hal_nfc_publish(const void *data, uint8_t len);
+void hal_uart_putc(char c);
+void hal_uart_drain(void);
+
+void sim_delay_us(double us);
+void sim_interrupts(bool enable);
+bool sim_interrupts_off(void);
+uint8_t *sim_userrow(void);
+uint8_t *sim_eeprom(void);
+
+#endif
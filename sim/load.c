@@ -0,0 +1,363 @@
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "cmd.h"
+#include "perf.h"
+#include "sim.h"
+
+// Bus contention load test.  Runs n switches (each its own copy of the firmware) against one bus with m control
+// gear, with every switch pressed at (nearly) the same moment a few times over, as at an "all off" walking out of
+// a room, or everyone dimming at once.  Sweeps the number of switches, how far apart the presses are, how long
+// they're held and the repeat interval of held dims, and reports for each combination:
+//  - commands delivered to the gear, as a share of the ones the firmware tried to send, and per second
+//  - collisions, retries, frames given up on, and deferrals (somebody else started first), from the firmware
+//  - how busy the bus was, from the first press to the last frame
+//  - latency from each press to its switch's first delivered command, over all the switches, and with -v per switch
+//
+//   daliload [-v] [-j jobs] [-n list] [-s list] [-h list] [-r list] [-m gear] [-c count] [-e every] <firmware.so>
+//
+// Lists are comma separated.  -s is the skew: each press lands at a (repeatable) random point up to that many ms
+// after the others.  -h is the hold time in ms, and -r the time between the steps of a held dim in ms (repeatTimer,
+// and rampInterval up to 255).  Switch i controls gear i % m.
+// Each combination runs in its own process, up to jobs (default, one per core) at a time.
+// Fails if any switch sends before the bus has settled, uses the PHY before it's powered up, or is reset by the
+// watchdog (VIOLATIONS), whatever the load.
+
+#define MAX_VALUES (16)
+#define MAX_POINTS (1024)
+
+// When the first press lands, and how long to let things finish after the last one.
+#define START_MS    (500)
+#define TAIL_MS     (2000)
+
+// Userrow for every switch: one button on pin 6, the target filled in per switch, and the timers from the default
+// config other than repeatTimer.
+#define BUTTON_PIN  (6)
+static const uint8_t userrow[] = { 0x01, 0x03, 0x05, 0x07, 0x09, 0x0b, 0xa3, 0x00, 0xd0, 0x03, 0xf4, 0x00, 0x00, 0xff, 0x00, 0x00 };
+#define USERROW_TARGET  (1)
+#define USERROW_REPEAT  (10)
+#define USERROW_RAMP_INTERVAL   (30)
+
+typedef struct {
+    double values[MAX_VALUES];
+    int count;
+} sweep_t;
+
+typedef struct {
+    int gestures;
+    // Gestures where none of the switch's commands got through.
+    int missed;
+    double p50;
+    double p90;
+    double p99;
+    uint32_t delivered;
+    dali_stats_t stats;
+} switch_result_t;
+
+typedef struct {
+    int n;
+    double skew;
+    double hold;
+    double repeat;
+
+    int gestures;
+    int missed;
+    // Commands the firmware sent or gave up on, and those the gear got.
+    uint32_t commands;
+    uint32_t delivered;
+    dali_stats_t stats;
+    double seconds;
+    // Fraction of the time the bus was busy.
+    double busy;
+    double p50;
+    double p90;
+    double p99;
+    uint32_t violations;
+    switch_result_t switches[SIM_MAX_DEVICES];
+} point_t;
+
+
+static bool parse_list(const char *arg, sweep_t *sweep) {
+    sweep->count = 0;
+    const char *p = arg;
+    while (*p && sweep->count < MAX_VALUES) {
+        char *end;
+        sweep->values[sweep->count++] = strtod(p, &end);
+        if (end == p || (*end && *end != ',')) {
+            return false;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return *p == '\0';
+}
+
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db;
+}
+
+// Nearest rank
+static double percentile(const double *sorted, int n, double pct) {
+    if (n == 0) {
+        return 0;
+    }
+    int rank = (int) ceil(pct / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+
+static void set_up(point_t *point, int gear, int count, double every) {
+    // Small LCG, so that runs are repeatable.
+    uint32_t seed = 1;
+    for (int g = 0; g < gear; g++) {
+        sim_gear_t *gr = gear_add(g);
+        gr->last_active = 200;
+    }
+    for (int i = 0; i < point->n; i++) {
+        sim_device_t *dev = sim_add_device();
+        memcpy(dev->userrow, userrow, sizeof(userrow));
+        dev->userrow[USERROW_TARGET] = (i % gear) << 1 | 1;
+        dev->userrow[USERROW_REPEAT] = (uint16_t) point->repeat & 0xFF;
+        dev->userrow[USERROW_REPEAT + 1] = (uint16_t) point->repeat >> 8;
+        dev->userrow[USERROW_RAMP_INTERVAL] = point->repeat < 255 ? (uint8_t) point->repeat : 254;
+        for (int k = 0; k < count; k++) {
+            seed = seed * 1103515245 + 12345;
+            double skew = point->skew * ((seed >> 16) & 0x7FFF) / 32768.0;
+            sim_time_t at = (sim_time_t) ((START_MS + k * every + skew) * SIM_NS_PER_MS);
+            sim_add_press(dev, BUTTON_PIN, at, (sim_time_t) (point->hold * SIM_NS_PER_MS), 0);
+        }
+    }
+    sim.end = (sim_time_t) ((START_MS + (count - 1) * every + point->skew + point->hold + TAIL_MS) * SIM_NS_PER_MS);
+}
+
+
+static int compare_u64_pair(const void *a, const void *b) {
+    sim_time_t ta = *(const sim_time_t *) a, tb = *(const sim_time_t *) b;
+    return ta < tb ? -1 : ta > tb;
+}
+
+// Time the bus was held low by anybody, or carrying a frame, between from and to.  Frames are mostly in order of
+// start, but not quite (gear replies are added ahead of time), so sort them first.
+static sim_time_t busy_time(sim_time_t from, sim_time_t *to) {
+    sim_time_t (*spans)[2] = malloc(sim.num_tx * sizeof(*spans));
+    for (int i = 0; i < sim.num_tx; i++) {
+        spans[i][0] = sim.tx[i].start;
+        spans[i][1] = sim.tx[i].end;
+    }
+    qsort(spans, sim.num_tx, sizeof(*spans), compare_u64_pair);
+    sim_time_t busy = 0, until = from;
+    for (int i = 0; i < sim.num_tx; i++) {
+        sim_time_t start = spans[i][0] > until ? spans[i][0] : until;
+        if (spans[i][1] > start) {
+            busy += spans[i][1] - start;
+            until = spans[i][1];
+        }
+    }
+    *to = until;
+    free(spans);
+    return busy;
+}
+
+
+static void measure(point_t *point) {
+    double *all = malloc(sim.num_devices * SIM_MAX_PRESSES * sizeof(double));
+    int num_all = 0;
+    for (int d = 0; d < sim.num_devices; d++) {
+        const sim_device_t *dev = &sim.devices[d];
+        switch_result_t *sw = &point->switches[d];
+        double latencies[SIM_MAX_PRESSES];
+        int num_latencies = 0;
+
+        for (int i = 0; i < sim.num_tx; i++) {
+            const sim_tx_t *tx = &sim.tx[i];
+            sw->delivered += tx->sender == dev->id && tx->delivered;
+        }
+        for (int g = 0; g < dev->num_gestures; g++) {
+            sim_time_t start = dev->gestures[g];
+            sim_time_t end = sim_gesture_end(dev, g);
+            bool found = false;
+            for (int i = 0; i < sim.num_tx && !found; i++) {
+                const sim_tx_t *tx = &sim.tx[i];
+                if (tx->sender == dev->id && tx->delivered && tx->start >= start && tx->start < end) {
+                    latencies[num_latencies++] = all[num_all++] = (tx->start - start) / 1e6;
+                    found = true;
+                }
+            }
+            sw->missed += !found;
+        }
+        qsort(latencies, num_latencies, sizeof(double), compare_double);
+        sw->gestures = dev->num_gestures;
+        sw->p50 = percentile(latencies, num_latencies, 50);
+        sw->p90 = percentile(latencies, num_latencies, 90);
+        sw->p99 = percentile(latencies, num_latencies, 99);
+        // The firmware's own count of how it got on sharing the bus.
+        const perf_t *perf = dlsym(dev->so, "perf");
+        if (perf) {
+            sw->stats = perf->dali;
+        }
+
+        point->gestures += sw->gestures;
+        point->missed += sw->missed;
+        point->delivered += sw->delivered;
+        point->commands += sw->stats.frames + sw->stats.dropped;
+        point->stats.frames += sw->stats.frames;
+        point->stats.collisions += sw->stats.collisions;
+        point->stats.retries += sw->stats.retries;
+        point->stats.dropped += sw->stats.dropped;
+        point->stats.deferrals += sw->stats.deferrals;
+        point->violations += dev->settling_violations + dev->phy_violations + dev->watchdog_resets;
+    }
+    qsort(all, num_all, sizeof(double), compare_double);
+    point->p50 = percentile(all, num_all, 50);
+    point->p90 = percentile(all, num_all, 90);
+    point->p99 = percentile(all, num_all, 99);
+    free(all);
+
+    sim_time_t from = START_MS * SIM_NS_PER_MS, to;
+    sim_time_t busy = busy_time(from, &to);
+    point->seconds = (to - from) / 1e9;
+    point->busy = to > from ? (double) busy / (to - from) : 0;
+}
+
+
+// Run one combination in a child process, which sends the result back down a pipe.  The result is well under the
+// pipe's buffer, so the child never waits on us to read it.
+static pid_t start_point(const char *firmware, point_t *point, int gear, int count, double every, int *fd) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        sim_reset();
+        set_up(point, gear, count, every);
+        sim_run(firmware);
+        measure(point);
+        if (write(fds[1], point, sizeof(*point)) != sizeof(*point)) {
+            exit(1);
+        }
+        exit(0);
+    }
+    close(fds[1]);
+    *fd = fds[0];
+    return pid;
+}
+
+
+static void print_point(const point_t *p, bool verbose) {
+    printf("%4d %8.0f %8.0f %9.0f %8d %6d %6u %6.1f %6.2f %6u %6u %6u %6u %6.1f %8.2f %8.2f %8.2f",
+           p->n, p->skew, p->hold, p->repeat, p->gestures, p->missed, p->commands,
+           p->commands ? 100.0 * p->delivered / p->commands : 0.0, p->seconds ? p->delivered / p->seconds : 0.0,
+           p->stats.collisions, p->stats.retries, p->stats.dropped, p->stats.deferrals, 100.0 * p->busy,
+           p->p50, p->p90, p->p99);
+    if (p->violations) {
+        printf("  VIOLATIONS x%u", p->violations);
+    }
+    printf("\n");
+    if (!verbose) {
+        return;
+    }
+    for (int i = 0; i < p->n; i++) {
+        const switch_result_t *sw = &p->switches[i];
+        printf("     dev%-3d %27d %6d %6u %6.1f %6s %6u %6u %6u %6u %6s %8.2f %8.2f %8.2f\n",
+               i, sw->gestures, sw->missed, sw->stats.frames + sw->stats.dropped,
+               sw->stats.frames + sw->stats.dropped ? 100.0 * sw->delivered / (sw->stats.frames + sw->stats.dropped) : 0.0, "",
+               sw->stats.collisions, sw->stats.retries, sw->stats.dropped, sw->stats.deferrals, "",
+               sw->p50, sw->p90, sw->p99);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    sweep_t n = { { 1, 2, 4, 8, 16, 32, 64 }, 7 };
+    sweep_t skew = { { 0, 20, 200 }, 3 };
+    sweep_t hold = { { 100, 1500 }, 2 };
+    sweep_t repeat = { { 244 }, 1 };
+    int gear = 16, count = 5;
+    double every = 4000;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool verbose = false;
+    bool ok = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "vj:n:s:h:r:m:c:e:")) != -1) {
+        switch (opt) {
+            case 'v': verbose = true; break;
+            case 'j': jobs = atol(optarg); break;
+            case 'n': ok &= parse_list(optarg, &n); break;
+            case 's': ok &= parse_list(optarg, &skew); break;
+            case 'h': ok &= parse_list(optarg, &hold); break;
+            case 'r': ok &= parse_list(optarg, &repeat); break;
+            case 'm': gear = atoi(optarg); break;
+            case 'c': count = atoi(optarg); break;
+            case 'e': every = strtod(optarg, NULL); break;
+            default: return 2;
+        }
+    }
+    if (!ok || argc - optind != 1 || gear < 1 || gear > SIM_MAX_GEAR || count < 1 || count > SIM_MAX_PRESSES || jobs < 1) {
+        fprintf(stderr, "usage: %s [-v] [-j jobs] [-n list] [-s list] [-h list] [-r list] [-m gear] [-c count] [-e every] <firmware.so>\n", argv[0]);
+        return 2;
+    }
+    const char *firmware = argv[optind];
+
+    static point_t points[MAX_POINTS];
+    int npoints = 0;
+    for (int a = 0; a < n.count; a++) {
+        for (int b = 0; b < skew.count; b++) {
+            for (int c = 0; c < hold.count; c++) {
+                for (int d = 0; d < repeat.count; d++) {
+                    if (n.values[a] < 1 || n.values[a] > SIM_MAX_DEVICES || npoints >= MAX_POINTS) {
+                        fprintf(stderr, "between 1 and %d switches, and at most %d combinations\n", SIM_MAX_DEVICES, MAX_POINTS);
+                        return 2;
+                    }
+                    point_t *p = &points[npoints++];
+                    p->n = (int) n.values[a];
+                    p->skew = skew.values[b];
+                    p->hold = hold.values[c];
+                    p->repeat = repeat.values[d];
+                }
+            }
+        }
+    }
+
+    // Keep up to jobs children going, collecting results as they finish.
+    static pid_t pids[MAX_POINTS];
+    static int fds[MAX_POINTS];
+    int started = 0, running = 0, done = 0;
+    bool failed = false;
+    while (done < npoints) {
+        while (running < jobs && started < npoints) {
+            pids[started] = start_point(firmware, &points[started], gear, count, every, &fds[started]);
+            started++;
+            running++;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        for (int i = 0; i < started; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            if (read(fds[i], &points[i], sizeof(point_t)) != sizeof(point_t) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%d switches, skew %.0f, hold %.0f, repeat %.0f failed\n", points[i].n, points[i].skew, points[i].hold, points[i].repeat);
+                failed = true;
+            }
+            close(fds[i]);
+        }
+        running--;
+        done++;
+    }
+
+    printf("%4s %8s %8s %9s %8s %6s %6s %6s %6s %6s %6s %6s %6s %6s %8s %8s %8s\n", "n", "skew ms", "hold ms", "repeat ms",
+           "gestures", "missed", "cmds", "deliv%", "cmd/s", "coll", "retry", "drop", "defer", "bus%", "p50 ms", "p90 ms", "p99 ms");
+    for (int i = 0; i < npoints; i++) {
+        print_point(&points[i], verbose);
+        failed |= points[i].violations != 0;
+    }
+    return failed ? 1 : 0;
+}
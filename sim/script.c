@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+// Scenario scripts.  One statement per line, # starts a comment.  Times are in ms unless noted.
+//
+//   run <ms>                               How long to simulate for
+//   device                                 Start a new switch.  Lines below apply to it.  One is implied.
+//   config <byte> <byte> ...               User row contents (hex), same layout as `make configure`
+//   eeprom <byte> <byte> ...               EEPROM contents (hex) from the start, as eeprom_t.  Otherwise erased.
+//   press <pin> at=<ms> hold=<ms> [bounce=<n>] [count=<n> every=<ms>] [vary=<ms>]
+//                                          count/every repeat the press.  vary adds up to that much (pseudo
+//                                          random, but repeatable) to each hold time.
+//   gear <addr> [level=] [last=] [min=] [max=] [phys=] [rate=] [groups=<hex>] [delay=<us>]
+
+#define MAX_LINE (256)
+
+
+// Looks for key=value in the remaining tokens.
+static bool get_arg(char **args, int nargs, const char *key, double *out) {
+    size_t len = strlen(key);
+    for (int i = 0; i < nargs; i++) {
+        if (strncmp(args[i], key, len) == 0 && args[i][len] == '=') {
+            *out = strtod(args[i] + len + 1, NULL);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_hex_arg(char **args, int nargs, const char *key, unsigned long *out) {
+    size_t len = strlen(key);
+    for (int i = 0; i < nargs; i++) {
+        if (strncmp(args[i], key, len) == 0 && args[i][len] == '=') {
+            *out = strtoul(args[i] + len + 1, NULL, 16);
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline sim_time_t ms(double v) {
+    return (sim_time_t) (v * SIM_NS_PER_MS);
+}
+
+
+bool script_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[MAX_LINE];
+    int lineno = 0;
+    sim_device_t *dev = NULL;
+    bool ok = true;
+    uint32_t seed = 1;
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        char *tokens[32];
+        int n = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok && n < 32; tok = strtok(NULL, " \t\r\n")) {
+            tokens[n++] = tok;
+        }
+        if (n == 0) {
+            continue;
+        }
+        char **args = tokens + 1;
+        int nargs = n - 1;
+        double v;
+        unsigned long hex;
+
+        if (strcmp(tokens[0], "run") == 0 && nargs == 1) {
+            sim.end = ms(strtod(args[0], NULL));
+        } else if (strcmp(tokens[0], "device") == 0) {
+            dev = sim_add_device();
+            ok = dev != NULL;
+        } else if (strcmp(tokens[0], "config") == 0) {
+            if (dev == NULL) {
+                dev = sim_add_device();
+            }
+            for (int i = 0; i < nargs && i < SIM_USERROW_SIZE; i++) {
+                dev->userrow[i] = strtoul(args[i], NULL, 16);
+            }
+        } else if (strcmp(tokens[0], "eeprom") == 0) {
+            if (dev == NULL) {
+                dev = sim_add_device();
+            }
+            for (int i = 0; i < nargs && i < SIM_EEPROM_SIZE; i++) {
+                dev->eeprom_bytes[i] = strtoul(args[i], NULL, 16);
+            }
+        } else if (strcmp(tokens[0], "press") == 0 && nargs >= 1) {
+            if (dev == NULL) {
+                dev = sim_add_device();
+            }
+            double at = 0, hold = 100, bounce = 0, count = 1, every = 0, vary = 0;
+            get_arg(args, nargs, "at", &at);
+            get_arg(args, nargs, "hold", &hold);
+            get_arg(args, nargs, "bounce", &bounce);
+            get_arg(args, nargs, "count", &count);
+            get_arg(args, nargs, "every", &every);
+            get_arg(args, nargs, "vary", &vary);
+            for (int i = 0; i < (int) count; i++) {
+                // Small LCG, so that runs are repeatable.
+                seed = seed * 1103515245 + 12345;
+                double extra = vary * ((seed >> 16) & 0x7FFF) / 32768.0;
+                sim_add_press(dev, atoi(args[0]), ms(at + i * every), ms(hold + extra), (int) bounce);
+            }
+        } else if (strcmp(tokens[0], "gear") == 0 && nargs >= 1) {
+            sim_gear_t *gear = gear_add(atoi(args[0]));
+            if (gear == NULL) {
+                ok = false;
+                break;
+            }
+            if (get_arg(args, nargs, "level", &v)) {
+                gear->level = v;
+            }
+            if (get_arg(args, nargs, "last", &v)) {
+                gear->last_active = v;
+            }
+            if (get_arg(args, nargs, "min", &v)) {
+                gear->min = v;
+            }
+            if (get_arg(args, nargs, "max", &v)) {
+                gear->max = v;
+            }
+            if (get_arg(args, nargs, "phys", &v)) {
+                gear->phys_min = v;
+            }
+            if (get_arg(args, nargs, "rate", &v)) {
+                gear->fade_rate = v;
+            }
+            if (get_hex_arg(args, nargs, "groups", &hex)) {
+                gear->groups = hex;
+            }
+            if (get_arg(args, nargs, "delay", &v)) {
+                gear->reply_delay = (sim_time_t) (v * SIM_NS_PER_US);
+            }
+        } else {
+            fprintf(stderr, "%s:%d: can't parse '%s'\n", path, lineno, tokens[0]);
+            ok = false;
+        }
+    }
+    fclose(f);
+    if (ok && sim.num_devices == 0) {
+        sim_add_device();
+    }
+    return ok;
+}
@@ -0,0 +1,593 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "hal.h"
+#include "sim.h"
+
+// Scheduler, and the HAL as seen by each simulated device.
+
+#define STACK_SIZE          (256 * 1024)
+// RTC runs from the 1024Hz internal oscillator
+#define RTC_HZ              (1024ULL)
+#define SIM_PIT_PERIOD_NS   (HAL_SAMPLE_TICKS * 1000000000ULL / RTC_HZ)
+// The watchdog is set to 8K cycles of the 1kHz ULP oscillator
+#define WDT_PERIOD_NS       (8192ULL * 1000000000ULL / RTC_HZ)
+
+sim_t sim;
+sim_device_t *sim_current;
+static ucontext_t scheduler_ctx;
+
+
+void sim_reset(void) {
+    free(sim.tx);
+    memset(&sim, 0, sizeof(sim));
+    sim.end = 10000 * SIM_NS_PER_MS;
+}
+
+
+sim_device_t *sim_add_device(void) {
+    if (sim.num_devices >= SIM_MAX_DEVICES) {
+        return NULL;
+    }
+    sim_device_t *dev = &sim.devices[sim.num_devices];
+    memset(dev, 0, sizeof(*dev));
+    dev->id = sim.num_devices++;
+    dev->frame_end = SIM_NEVER;
+    dev->alarm = SIM_NEVER;
+    dev->pit = SIM_NEVER;
+    dev->clock_hz = F_CPU;
+    // Same as the default `make configure` user row.
+    static const uint8_t default_userrow[] = { 0x01, 0x03, 0x05, 0x07, 0x09, 0x0b, 0xa3, 0x00, 0xd0, 0x03, 0xf4, 0x00, 0x00, 0xff, 0x00, 0x00 };
+    memset(dev->userrow, 0xFF, sizeof(dev->userrow));
+    memcpy(dev->userrow, default_userrow, sizeof(default_userrow));
+    memset(dev->eeprom_bytes, 0xFF, sizeof(dev->eeprom_bytes));
+    return dev;
+}
+
+
+static int compare_press(const void *a, const void *b) {
+    const sim_press_t *pa = a, *pb = b;
+    return pa->start < pb->start ? -1 : pa->start > pb->start;
+}
+
+static int compare_time(const void *a, const void *b) {
+    sim_time_t ta = *(const sim_time_t *) a, tb = *(const sim_time_t *) b;
+    return ta < tb ? -1 : ta > tb;
+}
+
+static void add_low(sim_device_t *dev, uint8_t pin, sim_time_t start, sim_time_t end) {
+    if (dev->num_presses >= SIM_MAX_PRESSES) {
+        fprintf(stderr, "Too many presses on device %d\n", dev->id);
+        exit(1);
+    }
+    sim_press_t *p = &dev->presses[dev->num_presses++];
+    p->pin = pin;
+    p->start = start;
+    p->end = end;
+}
+
+// A press is modelled as the pin being held low.  Bouncing contacts add short open circuits at
+// both the start and the end of the press.
+void sim_add_press(sim_device_t *dev, uint8_t pin, sim_time_t start, sim_time_t hold, int bounces) {
+    const sim_time_t contact = 400 * SIM_NS_PER_US;
+    const sim_time_t gap = 300 * SIM_NS_PER_US;
+    dev->gestures[dev->num_gestures++] = start;
+    qsort(dev->gestures, dev->num_gestures, sizeof(sim_time_t), compare_time);
+    sim_time_t t = start;
+    for (int i = 0; i < bounces; i++) {
+        add_low(dev, pin, t, t + contact);
+        t += contact + gap;
+    }
+    sim_time_t release = start + hold;
+    sim_time_t held_until = release - bounces * (contact + gap);
+    if (held_until < t) {
+        held_until = t;
+    }
+    add_low(dev, pin, t, held_until);
+    t = held_until + gap;
+    for (int i = 0; i < bounces; i++) {
+        add_low(dev, pin, t, t + contact);
+        t += contact + gap;
+    }
+    qsort(dev->presses, dev->num_presses, sizeof(sim_press_t), compare_press);
+}
+
+
+// A gesture lasts until the next one starts.
+sim_time_t sim_gesture_end(const sim_device_t *dev, int gesture) {
+    return gesture + 1 < dev->num_gestures ? dev->gestures[gesture + 1] : sim.end;
+}
+
+// Time spent awake (running or idle) during a gesture.
+sim_time_t sim_gesture_awake(const sim_device_t *dev, int gesture) {
+    sim_time_t end = gesture + 1 < dev->num_gestures ? dev->gesture_awake[gesture + 1] : dev->awake;
+    return end - dev->gesture_awake[gesture];
+}
+
+
+// Supply charge used during a gesture, in uC.
+double sim_gesture_charge(const sim_device_t *dev, int gesture) {
+    double end = gesture + 1 < dev->num_gestures ? dev->gesture_charge[gesture + 1] : dev->charge;
+    return end - dev->gesture_charge[gesture];
+}
+
+
+// Modelled supply current in this power state at the current clock, in uA.
+static double current(const sim_device_t *dev, sim_power_t state) {
+    double mhz = dev->clock_hz / 1e6;
+    double ua = state == POWER_RUN ? SIM_UA_OSC20M + SIM_UA_RUN_PER_MHZ * mhz :
+                state == POWER_IDLE ? SIM_UA_OSC20M + SIM_UA_IDLE_PER_MHZ * mhz :
+                state == POWER_STANDBY ? SIM_UA_STANDBY : SIM_UA_DOWN;
+    // The RTC in standby runs from the same oscillator as the watchdog.
+    if (dev->wdt_enabled && state != POWER_STANDBY) {
+        ua += SIM_UA_WDT;
+    }
+    if (dev->phy_powered) {
+        ua += SIM_UA_PHY;
+    }
+    return ua;
+}
+
+// Modelled supply current over the whole run, in uA.
+double sim_average_current(const sim_device_t *dev) {
+    sim_time_t total = 0;
+    for (int state = 0; state < POWER_STATES; state++) {
+        total += dev->power[state];
+    }
+    return total ? dev->charge / (total / 1e9) : 0;
+}
+
+
+bool sim_pin_low(const sim_device_t *dev, uint8_t pin, sim_time_t t) {
+    for (int i = 0; i < dev->num_presses && dev->presses[i].start <= t; i++) {
+        const sim_press_t *p = &dev->presses[i];
+        if (p->pin == pin && t < p->end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Earliest time at or after t that the pin is low, or SIM_NEVER
+static sim_time_t next_low(const sim_device_t *dev, uint8_t pin, sim_time_t t) {
+    for (int i = 0; i < dev->num_presses; i++) {
+        const sim_press_t *p = &dev->presses[i];
+        if (p->pin == pin && t < p->end) {
+            return p->start > t ? p->start : t;
+        }
+    }
+    return SIM_NEVER;
+}
+
+// Earliest time after t that the pin changes level, or SIM_NEVER
+static sim_time_t next_change(const sim_device_t *dev, uint8_t pin, sim_time_t t) {
+    for (int i = 0; i < dev->num_presses; i++) {
+        const sim_press_t *p = &dev->presses[i];
+        if (p->pin == pin && t < p->end) {
+            return p->start > t ? p->start : p->end;
+        }
+    }
+    return SIM_NEVER;
+}
+
+
+// ------------------------ Interrupts -------------------------------
+
+// Latch the pin interrupt flags for anything that happened up to t.  Level interrupts fire for as long as
+// the pin is low.
+static void update_intflags(sim_device_t *dev, sim_time_t t) {
+    for (uint8_t pin = 0; pin < 8; pin++) {
+        uint8_t bit = 1 << pin;
+        if ((dev->wake_mask & bit) && sim_pin_low(dev, pin, t)) {
+            dev->intflags |= bit;
+        }
+        if ((dev->change_mask & bit) && next_change(dev, pin, dev->intflags_at) <= t) {
+            dev->intflags |= bit;
+        }
+    }
+    dev->intflags_at = t;
+}
+
+// When the next interrupt is due in this power state, or SIM_NEVER.  The RTC counter stops in power down.
+static sim_time_t next_interrupt(sim_device_t *dev, sim_power_t state) {
+    update_intflags(dev, dev->now);
+    if (dev->intflags & (dev->wake_mask | dev->change_mask)) {
+        return dev->now;
+    }
+    sim_time_t next = state == POWER_DOWN ? SIM_NEVER : dev->alarm;
+    // The PIT keeps going in power down.
+    if (dev->pit < next) {
+        next = dev->pit;
+    }
+    for (uint8_t pin = 0; pin < 8; pin++) {
+        sim_time_t t = SIM_NEVER;
+        if (dev->wake_mask & (1 << pin)) {
+            t = next_low(dev, pin, dev->now);
+        } else if (dev->change_mask & (1 << pin)) {
+            t = next_change(dev, pin, dev->now);
+        }
+        if (t < next) {
+            next = t;
+        }
+    }
+    return next;
+}
+
+// Run the ISRs for whatever is pending now.
+static void take_interrupts(sim_device_t *dev) {
+    update_intflags(dev, dev->now);
+    dev->in_isr = true;
+    if (dev->alarm <= dev->now && dev->isr_rtc) {
+        dev->alarm = SIM_NEVER;
+        dev->isr_rtc();
+    }
+    if (dev->pit <= dev->now && dev->isr_pit) {
+        dev->pit += SIM_PIT_PERIOD_NS;
+        dev->isr_pit();
+    }
+    if ((dev->intflags & (dev->wake_mask | dev->change_mask)) && dev->isr_port) {
+        dev->isr_port();
+    }
+    dev->in_isr = false;
+}
+
+
+// true if anything else in the simulation is behind the current device, and should run first.
+static bool others_behind(const sim_device_t *dev) {
+    if (bus_pending() < dev->now) {
+        return true;
+    }
+    for (int i = 0; i < sim.num_devices; i++) {
+        const sim_device_t *other = &sim.devices[i];
+        if (other != dev && !other->finished && other->now < dev->now) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sim_yield(void) {
+    sim_device_t *dev = sim_current;
+    if (dev->now >= sim.end) {
+        // Out of time.  We never come back from this.
+        dev->finished = true;
+        swapcontext(&dev->ctx, &scheduler_ctx);
+    }
+    if (others_behind(dev)) {
+        swapcontext(&dev->ctx, &scheduler_ctx);
+    }
+}
+
+
+static void advance_to(sim_time_t until, sim_power_t state);
+
+void sim_advance(sim_time_t dt, sim_power_t state) {
+    sim_device_t *dev = sim_current;
+    sim_time_t until = dev->now + dt;
+    if (until > sim.end) {
+        until = sim.end;
+    }
+    // While we're awake, interrupts break into whatever we were doing.  Asleep, hal_sleep() takes care of them.
+    while (state < POWER_STANDBY && dev->interrupts && !dev->in_isr) {
+        sim_time_t t = next_interrupt(dev, state);
+        if (t > until) {
+            break;
+        }
+        advance_to(t, state);
+        take_interrupts(dev);
+    }
+    advance_to(until, state);
+}
+
+
+static void advance_to(sim_time_t until, sim_power_t state) {
+    sim_device_t *dev = sim_current;
+    if (until < dev->now) {
+        // An interrupt took us past it.
+        until = dev->now;
+    }
+    // Snapshot the awake time and charge at the start of any gesture we're passing.
+    double ua = current(dev, state);
+    while (dev->next_gesture < dev->num_gestures && dev->gestures[dev->next_gesture] <= until) {
+        sim_time_t t = dev->gestures[dev->next_gesture];
+        sim_time_t part = t > dev->now ? t - dev->now : 0;
+        dev->gesture_charge[dev->next_gesture] = dev->charge + part * ua / 1e9;
+        dev->gesture_awake[dev->next_gesture++] = dev->awake + (state < POWER_STANDBY ? part : 0);
+    }
+    dev->power[state] += until - dev->now;
+    if (state < POWER_STANDBY) {
+        dev->awake += until - dev->now;
+    }
+    dev->charge += (until - dev->now) * ua / 1e9;
+    dev->now = until;
+
+    // The watchdog keeps running while asleep.  We don't reboot the firmware, but count how often it would have.
+    if (dev->wdt_enabled && dev->now - dev->last_wdt_reset > WDT_PERIOD_NS) {
+        dev->watchdog_resets++;
+        dev->last_wdt_reset = dev->now;
+    }
+    sim_yield();
+}
+
+
+void sim_wait_until(sim_time_t t, sim_power_t state) {
+    if (t > sim_current->now) {
+        sim_advance(t - sim_current->now, state);
+    }
+}
+
+
+static inline void charge_call(void) {
+    sim_advance((sim_time_t) (SIM_CYCLES_PER_CALL * 1e9 / sim_current->clock_hz), POWER_RUN);
+}
+
+
+void sim_set_clock(sim_device_t *dev, unsigned long hz) {
+    dev->clock_hz = hz;
+}
+
+
+static void device_entry(void) {
+    sim_current->fw_main();
+    sim_current->finished = true;
+    swapcontext(&sim_current->ctx, &scheduler_ctx);
+}
+
+
+// Every device needs its own copy of the firmware's statics, so each one loads its own copy of the
+// shared object.  dlopen() would hand back the same instance for the same file, hence the temporary copy.
+static void load_firmware(sim_device_t *dev, const char *firmware) {
+    char path[] = "/tmp/dalisim-XXXXXX.so";
+    int fd = mkstemps(path, 3);
+    FILE *in = fopen(firmware, "rb");
+    if (fd < 0 || in == NULL) {
+        perror(firmware);
+        exit(1);
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (write(fd, buf, n) != (ssize_t) n) {
+            perror(path);
+            exit(1);
+        }
+    }
+    fclose(in);
+    close(fd);
+
+    dev->so = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    unlink(path);
+    if (dev->so == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+    dev->fw_main = (void (*)(void)) dlsym(dev->so, "firmware_main");
+    dev->isr_port = (void (*)(void)) dlsym(dev->so, "PORTA_PORT_vect");
+    dev->isr_rtc = (void (*)(void)) dlsym(dev->so, "RTC_CNT_vect");
+    dev->isr_pit = (void (*)(void)) dlsym(dev->so, "RTC_PIT_vect");
+    if (dev->fw_main == NULL) {
+        fprintf(stderr, "%s has no firmware_main\n", firmware);
+        exit(1);
+    }
+
+    dev->stack = malloc(STACK_SIZE);
+    getcontext(&dev->ctx);
+    dev->ctx.uc_stack.ss_sp = dev->stack;
+    dev->ctx.uc_stack.ss_size = STACK_SIZE;
+    dev->ctx.uc_link = &scheduler_ctx;
+    makecontext(&dev->ctx, device_entry, 0);
+}
+
+
+void sim_run(const char *firmware) {
+    for (int i = 0; i < sim.num_devices; i++) {
+        load_firmware(&sim.devices[i], firmware);
+    }
+
+    for (;;) {
+        // Run whatever is furthest behind.  The gear goes first on a tie, so that replies are on the
+        // bus before anybody looks for them.
+        sim_device_t *next = NULL;
+        for (int i = 0; i < sim.num_devices; i++) {
+            sim_device_t *dev = &sim.devices[i];
+            if (!dev->finished && (next == NULL || dev->now < next->now)) {
+                next = dev;
+            }
+        }
+        sim_time_t pending = bus_pending();
+        if (pending != SIM_NEVER && (next == NULL || pending <= next->now)) {
+            bus_process(pending);
+            continue;
+        }
+        if (next == NULL) {
+            break;
+        }
+        sim_current = next;
+        swapcontext(&scheduler_ctx, &next->ctx);
+    }
+    sim_current = NULL;
+}
+
+
+// ------------------------ HAL -------------------------------
+
+uint16_t hal_rtc_now(void) {
+    charge_call();
+    return (uint16_t) (sim_current->now * RTC_HZ / 1000000000ULL);
+}
+
+uint8_t hal_switch_read(void) {
+    charge_call();
+    uint8_t val = 0xFF;
+    for (uint8_t pin = 0; pin < 8; pin++) {
+        if (sim_pin_low(sim_current, pin, sim_current->now)) {
+            val &= ~(1 << pin);
+        }
+    }
+    return val;
+}
+
+void hal_switch_init(uint8_t mask) {
+    sim_current->switch_mask |= mask;
+}
+
+void hal_switch_sense(uint8_t mask, uint8_t sense) {
+    sim_device_t *dev = sim_current;
+    charge_call();
+    // Anything that happened under the old sense still counts.
+    update_intflags(dev, dev->now);
+    dev->wake_mask &= ~mask;
+    dev->change_mask &= ~mask;
+    if (sense == SWITCH_SENSE_WAKE) {
+        dev->wake_mask |= mask;
+    } else if (sense == SWITCH_SENSE_CHANGE) {
+        dev->change_mask |= mask;
+    }
+}
+
+void hal_rtc_alarm(uint16_t at) {
+    charge_call();
+    sim_device_t *dev = sim_current;
+    uint64_t now = dev->now * RTC_HZ / 1000000000ULL;
+    uint16_t ahead = at - (uint16_t) now;
+    // The compare matches when the counter gets there, which is next time around if it's already there.
+    uint64_t tick = now + (ahead ? ahead : 0x10000);
+    dev->alarm = (tick * 1000000000ULL + RTC_HZ - 1) / RTC_HZ;
+}
+
+void hal_sample_timer(bool on) {
+    charge_call();
+    sim_device_t *dev = sim_current;
+    // Every HAL_SAMPLE_TICKS RTC cycles, whenever it was turned on.
+    dev->pit = on ? (dev->now / SIM_PIT_PERIOD_NS + 1) * SIM_PIT_PERIOD_NS : SIM_NEVER;
+}
+
+void hal_rtc_alarm_off(void) {
+    sim_current->alarm = SIM_NEVER;
+}
+
+uint8_t hal_switch_pending(void) {
+    return sim_current->intflags;
+}
+
+void hal_switch_ack(uint8_t mask) {
+    sim_current->intflags &= ~mask;
+}
+
+// Same as the hardware, interrupts go on as we go to sleep.
+void hal_sleep(uint8_t mode) {
+    sim_device_t *dev = sim_current;
+    sim_power_t state = mode == SLEEP_DEEP ? POWER_DOWN : POWER_STANDBY;
+    dev->interrupts = true;
+    sim_time_t wake = next_interrupt(dev, state);
+    if (wake == SIM_NEVER) {
+        wake = sim.end;
+    }
+    sim_wait_until(wake, state);
+    dev->wakeups++;
+    take_interrupts(dev);
+}
+
+void sim_interrupts(bool enable) {
+    sim_current->interrupts = enable;
+}
+
+// Returns whether they were on.
+bool sim_interrupts_off(void) {
+    bool was = sim_current->interrupts;
+    sim_current->interrupts = false;
+    return was;
+}
+
+void hal_reset(void) {
+    fprintf(stderr, "device %d: software reset is not simulated\n", sim_current->id);
+}
+
+void hal_wdt_reset(void) {
+    charge_call();
+    sim_current->last_wdt_reset = sim_current->now;
+}
+
+void hal_wdt_enable(bool enable) {
+    charge_call();
+    sim_device_t *dev = sim_current;
+    if (enable && !dev->wdt_enabled) {
+        dev->last_wdt_reset = dev->now;
+    }
+    dev->wdt_enabled = enable;
+}
+
+void hal_init(void) {
+    // The start up delay from SYSCFG1 and the register writes.
+    charge_call();
+    sim_current->wdt_enabled = true;
+    sim_current->last_wdt_reset = sim_current->now;
+    sim_set_clock(sim_current, CLOCK_HZ(CLOCK_FAST_DIV));
+}
+
+// _delay_us() counts cycles assuming F_CPU, so takes longer on a slower clock.
+void sim_delay_us(double us) {
+    sim_advance((sim_time_t) (us * SIM_NS_PER_US * F_CPU / sim_current->clock_hz), POWER_RUN);
+}
+
+uint8_t *sim_userrow(void) {
+    return sim_current->userrow;
+}
+
+uint8_t *sim_eeprom(void) {
+    return sim_current->eeprom_bytes;
+}
+
+// Something different for every device, in place of the serial number.
+uint16_t hal_seed(void) {
+    return 0x5EED ^ (sim_current->id * 0x9E37);
+}
+
+void hal_eeprom_write(uint8_t offset, const void *data, uint8_t len) {
+    charge_call();
+    sim_device_t *dev = sim_current;
+    if (offset + len > SIM_EEPROM_SIZE) {
+        fprintf(stderr, "device %d: EEPROM write past the end\n", dev->id);
+        exit(1);
+    }
+    // Same as the hardware, nothing is written if nothing has changed.
+    if (memcmp(dev->eeprom_bytes + offset, data, len) != 0) {
+        memcpy(dev->eeprom_bytes + offset, data, len);
+        dev->eeprom_writes++;
+    }
+}
+
+uint8_t hal_reset_cause(void) {
+    return 0x01;
+}
+
+// Reading the mailbox control register, emptying it, and the message itself.
+bool hal_nfc_publish(const void *data, uint8_t len) {
+    sim_device_t *dev = sim_current;
+    charge_call();
+    sim_advance((4 * SIM_I2C_START_BYTES + 2 + len) * SIM_I2C_BYTE_NS, POWER_RUN);
+    memcpy(dev->mailbox, data, len);
+    dev->mailbox_len = len;
+    dev->mailbox_writes++;
+    return true;
+}
+
+// Printed a line at a time, as of when its last byte went out.
+void hal_uart_putc(char c) {
+    sim_device_t *dev = sim_current;
+    sim_advance(SIM_UART_BYTE_NS, POWER_RUN);
+    if (c == '\n') {
+        if (sim.trace) {
+            printf("%10.3f ms  dev%-3d %.*s\n", dev->now / 1e6, dev->id, dev->uart_len, dev->uart);
+        }
+        dev->uart_len = 0;
+    } else if (dev->uart_len < SIM_UART_LINE) {
+        dev->uart[dev->uart_len++] = c;
+    }
+}
+
+void hal_uart_drain(void) {
+}
@@ -0,0 +1,239 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+// Host side simulation of one or more light switches sharing a DALI bus with some control gear.
+//
+// Each simulated switch runs an unmodified copy of the firmware (loaded from a shared object, so every
+// device gets its own statics) on its own coroutine.  Time is virtual, in nanoseconds, and only moves
+// when the firmware sleeps, waits on the bus, or calls into the HAL (which charges a few CPU cycles).
+// The scheduler always resumes whichever device is furthest behind, so whenever firmware code is running
+// everything that could have happened on the bus before "now" already has.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#define SIM_MAX_DEVICES     (64)
+#define SIM_MAX_GEAR        (64)
+#define SIM_MAX_PRESSES     (256)
+#define SIM_USERROW_SIZE    (32)
+#define SIM_EEPROM_SIZE     (128)
+// Longest line of UART output we print in one go.
+#define SIM_UART_LINE       (512)
+
+#define SIM_NS_PER_MS       (1000000ULL)
+#define SIM_NS_PER_US       (1000ULL)
+#define SIM_NEVER           (UINT64_MAX)
+
+// DALI timing, in ns.
+#define SIM_HALF_BIT_NS     (416667ULL)
+
+// Cost charged against the device for each HAL call, as a stand in for the instructions around it.  The time it
+// takes depends on which clock the firmware is running from.
+#define SIM_CYCLES_PER_CALL (40)
+
+// Supply current model, in uA, for the ATtiny804 at 3V.  Typical figures from the datasheet, so only good for
+// comparing one version of the firmware against another.  Awake, the 20MHz oscillator runs whatever the prescaler is
+// set to, and the rest scales with the CPU clock (which gives 1100uA running and 450uA idle at 3.33MHz).
+#define SIM_UA_OSC20M       (125.0)
+#define SIM_UA_RUN_PER_MHZ  (292.5)
+#define SIM_UA_IDLE_PER_MHZ (97.5)
+// Standby with the RTC running from the 1kHz ULP oscillator.
+#define SIM_UA_STANDBY      (0.7)
+#define SIM_UA_DOWN         (0.1)
+// On top of the above.  The watchdog keeps the ULP oscillator going, which the RTC in standby already has.
+#define SIM_UA_WDT          (0.6)
+// The comparator on the DALI input, plus the 0.55V reference it uses.
+#define SIM_UA_PHY          (100.0)
+// How long the comparator and reference take to start up.
+#define SIM_PHY_POWER_UP_NS (25 * SIM_NS_PER_US)
+// One byte at 115200 8N1.
+#define SIM_UART_BYTE_NS    (86806ULL)
+// One byte on the 100kHz I2C bus to the ST25DV, and the start, address and register around a transfer.
+#define SIM_I2C_BYTE_NS     (90000ULL)
+#define SIM_I2C_START_BYTES (4)
+// The ST25DV's fast transfer mode mailbox.
+#define SIM_MAILBOX_SIZE    (256)
+
+typedef uint64_t sim_time_t;
+
+typedef enum {
+    POWER_RUN,
+    POWER_IDLE,
+    POWER_STANDBY,
+    POWER_DOWN,
+    POWER_STATES,
+} sim_power_t;
+
+// A period during which a button pin is held low.
+typedef struct {
+    uint8_t pin;
+    sim_time_t start;
+    sim_time_t end;
+} sim_press_t;
+
+typedef struct {
+    int id;
+    sim_time_t now;
+    bool finished;
+
+    // The firmware instance this device runs.
+    void *so;
+    void (*fw_main)(void);
+    void (*isr_port)(void);
+    void (*isr_rtc)(void);
+    void (*isr_pit)(void);
+    ucontext_t ctx;
+    void *stack;
+
+    // Peripheral state
+    uint8_t userrow[SIM_USERROW_SIZE];
+    uint8_t eeprom_bytes[SIM_EEPROM_SIZE];
+    uint8_t switch_mask;
+    // Pins interrupting on a low level.
+    uint8_t wake_mask;
+    // Pins interrupting on either edge.
+    uint8_t change_mask;
+    // When the RTC compare interrupt is due, or SIM_NEVER.
+    sim_time_t alarm;
+    // When the next PIT interrupt is due, or SIM_NEVER if it's off.
+    sim_time_t pit;
+    // Global interrupt enable, and whether we're in an ISR already.
+    bool interrupts;
+    bool in_isr;
+    uint8_t intflags;
+    // Pin interrupt flags are up to date as of this time.
+    sim_time_t intflags_at;
+    bool wdt_enabled;
+    sim_time_t last_wdt_reset;
+    // CPU clock, in Hz.
+    double clock_hz;
+    // Whether the comparator is on, and since when.
+    bool phy_powered;
+    sim_time_t phy_powered_at;
+    // End of the last frame the PHY sent or saw, or SIM_NEVER.
+    sim_time_t frame_end;
+    // UART output so far of the line being sent.
+    char uart[SIM_UART_LINE];
+    int uart_len;
+    // Last message put in the NFC mailbox.
+    uint8_t mailbox[SIM_MAILBOX_SIZE];
+    int mailbox_len;
+
+    // Scripted button activity, sorted by start time.
+    sim_press_t presses[SIM_MAX_PRESSES];
+    int num_presses;
+
+    // Start of each scripted press (ignoring bounces), and how much awake time and charge had been used by then.
+    sim_time_t gestures[SIM_MAX_PRESSES];
+    sim_time_t gesture_awake[SIM_MAX_PRESSES];
+    double gesture_charge[SIM_MAX_PRESSES];
+    int num_gestures;
+    int next_gesture;
+
+    // Statistics
+    sim_time_t power[POWER_STATES];
+    sim_time_t awake;
+    // Modelled supply charge, in uC.
+    double charge;
+    uint32_t wakeups;
+    uint32_t frames_sent;
+    uint32_t watchdog_resets;
+    uint32_t eeprom_writes;
+    uint32_t mailbox_writes;
+    // Forward frames sent too soon after the previous frame on the bus.
+    uint32_t settling_violations;
+    // Frames cut short because somebody else was transmitting.
+    uint32_t collisions;
+    // Times the PHY was used without the comparator being on, or before it had started up.
+    uint32_t phy_violations;
+} sim_device_t;
+
+typedef struct {
+    // Short address, or -1 if not addressed.
+    int addr;
+    uint16_t groups;
+    uint8_t level;
+    uint8_t last_active;
+    uint8_t min;
+    uint8_t max;
+    uint8_t phys_min;
+    uint8_t fade_rate;
+    uint8_t dtr0;
+    // Time from the end of a forward frame to the start of our reply.
+    sim_time_t reply_delay;
+
+    // Statistics
+    uint32_t frames_seen;
+    uint32_t replies;
+    uint32_t level_changes;
+} sim_gear_t;
+
+// A frame on the bus, forward or backward.
+typedef struct {
+    // Device index, or -1 - gear index for a backward frame.
+    int sender;
+    bool backward;
+    sim_time_t start;
+    // Time the sender released the bus.
+    sim_time_t end;
+    // Left aligned, including the start bit.
+    uint32_t frame;
+    uint8_t nbits;
+    // Not a frame, but the bus held low, after a collision.
+    bool brk;
+    // Whether the gear has had a chance to act on it yet.
+    bool processed;
+    // Set if the frame was received by gear without interference, and changed a light level.
+    bool delivered;
+    bool changed_level;
+} sim_tx_t;
+
+typedef struct {
+    sim_time_t end;
+    sim_device_t devices[SIM_MAX_DEVICES];
+    int num_devices;
+    sim_gear_t gear[SIM_MAX_GEAR];
+    int num_gear;
+    sim_tx_t *tx;
+    int num_tx;
+    int max_tx;
+    // Index of the first frame that hasn't yet been processed by the gear.
+    int first_unprocessed;
+    bool trace;
+} sim_t;
+
+extern sim_t sim;
+extern sim_device_t *sim_current;
+
+// sim.c
+void sim_reset(void);
+sim_device_t *sim_add_device(void);
+void sim_add_press(sim_device_t *dev, uint8_t pin, sim_time_t start, sim_time_t hold, int bounces);
+sim_time_t sim_gesture_end(const sim_device_t *dev, int gesture);
+sim_time_t sim_gesture_awake(const sim_device_t *dev, int gesture);
+double sim_gesture_charge(const sim_device_t *dev, int gesture);
+double sim_average_current(const sim_device_t *dev);
+bool sim_pin_low(const sim_device_t *dev, uint8_t pin, sim_time_t t);
+void sim_run(const char *firmware);
+void sim_advance(sim_time_t dt, sim_power_t state);
+void sim_wait_until(sim_time_t t, sim_power_t state);
+void sim_set_clock(sim_device_t *dev, unsigned long hz);
+
+// bus.c
+sim_tx_t *bus_transmit(int sender, bool backward, sim_time_t start, uint32_t frame, uint8_t nbits);
+bool bus_level(sim_time_t t);
+void bus_check_phy_powered(sim_device_t *dev);
+int bus_edges(sim_time_t from, sim_time_t to, sim_time_t *edges, int max);
+sim_time_t bus_pending(void);
+void bus_process(sim_time_t upto);
+sim_time_t frame_duration(uint8_t nbits);
+
+// gear.c
+sim_gear_t *gear_add(int addr);
+bool gear_forward_frame(sim_gear_t *gear, uint8_t addr, uint8_t cmd, uint8_t *reply, bool *changed);
+
+// script.c
+bool script_load(const char *path);
+
+#endif
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <string.h>
+#include "unpack.h"
+
+// The bootloader's unpacker, built for the host, so that pack.py can check it against its own (pack.py --test).
+// Reads a packed image (.lz) on stdin, unpacks each page into the flash below it as the bootloader would, and
+// writes the page number and page for each to stdout.  Fails on a stream that doesn't unpack to exactly a page.
+//
+//   unpack < build/main.lz
+
+static uint8_t flash[UPDATE_APP_END];
+static uint8_t window[UPDATE_PAGE_SIZE];
+static uint8_t packed[UPDATE_PACKED_MAX];
+
+
+int main(void) {
+    memset(flash, 0xFF, sizeof(flash));
+    int number;
+    while ((number = getchar()) != EOF) {
+        int len = getchar();
+        if (len == EOF || len > UPDATE_PACKED_MAX || fread(packed, 1, len, stdin) != (size_t) len) {
+            fprintf(stderr, "page %d is cut short\n", number);
+            return 1;
+        }
+        if (number < UPDATE_FIRST_PAGE || number >= UPDATE_FIRST_PAGE + UPDATE_PAGES) {
+            fprintf(stderr, "page %d is outside the application\n", number);
+            return 1;
+        }
+        uint8_t *page = flash + number * UPDATE_PAGE_SIZE;
+        if (!update_unpack(page, window, packed, len)) {
+            fprintf(stderr, "page %d doesn't unpack\n", number);
+            return 1;
+        }
+        putchar(number);
+        fwrite(page, 1, UPDATE_PAGE_SIZE, stdout);
+    }
+    return 0;
+}
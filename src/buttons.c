@@ -1,45 +1,59 @@
-#include <avr/io.h>
-#include <util/delay.h>
 #include <inttypes.h>
-#include <avr/interrupt.h>
-#include <avr/sleep.h>
-#include <avr/wdt.h>
-#include <util/atomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include "buttons.h"
 #include "config.h"
 #include <stdlib.h>
 #include "cmd.h"
-
-
-// For test board, switch is on PA6
-#define SWITCH_PORT PORTA
-#define MS_TO_RTC_TICKS(m) (m * 1024 / 1000)
+#include "dim.h"
+#include "hal.h"
+#include "perf.h"
+#include "power.h"
+#include "trace.h"
+
+
+// light_level value for a target we know is on, but not at what level (e.g. after GO_TO_LAST_ACTIVE_LEVEL or dimming)
+#define LEVEL_ON_UNKNOWN (0xFF)
+// ramp_pos of a dim that's being done with UP and DOWN rather than along the curve.
+#define RAMP_NONE (0xFFFF)
+// How long we trust a cached light level for (a minute).  Something else on the bus (the home automation
+// system, another switch) could have changed it in the meantime.
+#define LEVEL_MAX_AGE_TICKS (60U * 1024)
+
+// The buttons are sampled every HAL_SAMPLE_TICKS for debouncing.  A button has to read the same 4 times in a row
+// (~6ms) to change state.
+// Don't bother sleeping for a deadline closer than this.  A write to RTC.CMP takes a couple of RTC cycles to
+// take effect, and the counter could get past it in the meantime, which would have us sleep for a minute.
+#define MIN_SLEEP_TICKS (3)
 struct button_t;
 
 typedef enum {
     BTN_STATE_RELEASED,
-    BTN_STATE_DEBOUNCING,
     BTN_STATE_PRESSED,
     BTN_STATE_LONGHELD,
-    BTN_STATE_RELEASE_DEBOUNCE,
     BTN_STATE_RELEASED_WAIT_FOR_REPRESS,
 } button_state_t; 
 
-
+// What the debouncer has seen happen to a button since it was last polled.
 typedef enum {
-    SLEEP_STATE_PROCESSING,
-    SLEEP_STATE_WAITING,
-    SLEEP_STATE_SLEEP_READY
-} sleep_state_t;
+    BTN_EVENT_NONE,
+    BTN_EVENT_PRESS,
+    BTN_EVENT_RELEASE,
+} button_event_t;
 
+// One debounced change of a button's pin, and the RTC time it happened.
+typedef struct {
+    uint8_t mask;
+    uint8_t event;
+    uint16_t at;
+} input_event_t;
 
-static sleep_state_t sleepState = SLEEP_STATE_PROCESSING;
-static uint16_t idleTimeout;
+// Room for a few changes of every button, which is plenty for the longest we're busy on the bus.  Power of 2.
+#define EVENT_QUEUE_SIZE (16)
 
 
-typedef void (*state_handler_t)(struct button_t *btn, const uint8_t button_level);
+typedef void (*state_handler_t)(struct button_t *btn, button_event_t event, uint16_t now);
 typedef struct button_t {
     // Index of the button.
     uint8_t index;
@@ -47,6 +61,11 @@ typedef struct button_t {
     // Dimming Direction.
     dali_gear_command_t direction;
 
+    // Where a dim has got to along the curve in dim.c, or RAMP_NONE.
+    uint16_t ramp_pos;
+    // Whether the last step of a dim along the curve sent a DAPC, so the gear's DAPC sequence is still going.
+    bool dapc_sequence;
+
     // RTC timeout for next 
     uint16_t timeout;
 
@@ -56,172 +75,588 @@ typedef struct button_t {
     // The state handler.
     button_state_t state;
 
-    // The last read light level for this target.
+    // The last known light level for this target. Kept while we sleep, so that a tap doesn't need to ask first.
     uint8_t light_level;
+
+    // Whether light_level can be trusted, and the RTC time we learnt it.  Stale levels are dropped by poll_buttons(),
+    // which we wake up for, so this never gets far enough behind to wrap.
+    bool level_known;
+    uint16_t level_time;
+
+    // The level GO_TO_LAST_ACTIVE_LEVEL will go to, if we know it (i.e. what it was before we turned it off).
+    uint8_t last_active;
+
+    // As an input device, whether this is the second press of a double press.
+    bool repressed;
 } button_t;
 
-static void released(button_t *btn, const uint8_t button_level);
-static void pressed(button_t *btn, const uint8_t button_level);
-static void long_pressed(button_t *btn, const uint8_t button_level);
-static void wait_for_repress(button_t *btn, const uint8_t button_level);
-static void long_pressed(button_t *btn, const uint8_t button_level);
+static void released(button_t *btn, button_event_t event, uint16_t now);
+static void pressed(button_t *btn, button_event_t event, uint16_t now);
+static void long_pressed(button_t *btn, button_event_t event, uint16_t now);
+static void wait_for_repress(button_t *btn, button_event_t event, uint16_t now);
+
+static const uint8_t button_pins[MAX_BUTTONS] = BUTTON_PINS;
+static button_t buttons[MAX_BUTTONS];
+static uint8_t num_buttons;
+// All the pins in use.
+static uint8_t all_mask;
+
+// Debouncing is done for the whole port at once, from the PIT interrupt.  Each pin has a 2 bit
+// counter, kept "vertically" (bit n of ct0 and ct1 make up pin n's counter), which counts the samples in a
+// row that differ from the debounced state, and resets on any that doesn't.  The debounced state flips
+// when it wraps, on the 4th.  This takes the same few instructions however many buttons there are.
+static volatile uint8_t debounced = 0xFF;
+static uint8_t ct0 = 0xFF;
+static uint8_t ct1 = 0xFF;
+// When the last 4 samples were taken.  A pin changes state on the 4th sample in a row that disagrees with it, so
+// the oldest of them is when it really changed (the pin interrupt, unless it bounced).
+static uint16_t sample_times[4];
+static uint8_t num_samples;
+
+// Changes the debouncer has seen, in order, for poll_buttons() to work through.  The ISR only ever moves the head
+// and poll_buttons() the tail, so neither needs to lock the other out.  Both count up forever, and wrap.
+static input_event_t event_queue[EVENT_QUEUE_SIZE];
+static volatile uint8_t event_head;
+static volatile uint8_t event_tail;
+// Set while a pin is part way to changing state, and the PIT is sampling it.
+static volatile bool sampling;
+
+static void debounce();
+static void check_targets();
+
+
+void buttons_init() {
+    num_buttons = config->numButtons > MAX_BUTTONS ? MAX_BUTTONS : config->numButtons;
+    for (uint8_t i = 0; i < num_buttons; i++) {
+        button_t *btn = &buttons[i];
+        btn->index = i;
+        btn->state = BTN_STATE_RELEASED;
+        btn->mask = button_pins[i];
+        btn->light_level = 0;
+        btn->level_known = false;
+        btn->last_active = LEVEL_ON_UNKNOWN;
+        btn->direction = DALI_CMD_DOWN;
+        all_mask |= btn->mask;
+    }
+    check_targets();
+    // Set all the pins as inputs, with pullup.
+    hal_switch_init(all_mask);
+    debounce();
+}
+
 
-static button_t buttons[NUM_BUTTONS] = {
-    {
-        .index = 0,
-        .state = BTN_STATE_RELEASED,
-        .mask = PIN6_bm,
-        .light_level = 0,
-        .direction = DALI_CMD_DOWN,
-        .timeout = 0,
+static void debounce_sample() {
+    sample_times[num_samples++ & 3] = hal_rtc_now();
+    uint8_t changed = debounced ^ hal_switch_read();
+    ct0 = ~(ct0 & changed);
+    ct1 = ct0 ^ (ct1 & changed);
+    changed &= ct0 & ct1 & all_mask;
+    debounced ^= changed;
+
+    for (uint8_t mask = 1; changed; mask <<= 1) {
+        if (changed & mask) {
+            changed &= ~mask;
+            uint8_t head = event_head;
+            if ((uint8_t) (head - event_tail) < EVENT_QUEUE_SIZE) {
+                input_event_t *ev = &event_queue[head & (EVENT_QUEUE_SIZE - 1)];
+                ev->mask = mask;
+                ev->event = (debounced & mask) ? BTN_EVENT_RELEASE : BTN_EVENT_PRESS;
+                ev->at = sample_times[num_samples & 3];
+                event_head = head + 1;
+                TRACE_POINT(TRACE_INPUT, ev->event == BTN_EVENT_RELEASE ? mask | 0x80 : mask);
+            }
+        }
     }
-};
+}
+
+// true if no pin is part way to changing state.
+static inline bool debounce_idle() {
+    return (uint8_t) ((ct0 & ct1) | ~all_mask) == 0xFF;
+}
 
 
-void buttons_init() {
-    // Set up pins with pullup, with no interrupt.  the interrupt will be turned on while sleeping.
-    SWITCH_PORT.PIN6CTRL = PORT_PULLUPEN_bm;
+// Sample the buttons.  If one of them is on its way to changing, keep sampling on the PIT until it has settled.
+// Otherwise there's nothing to do until a pin changes, so let that interrupt us.  The pin interrupt goes on before
+// the sample, so that a change just after it isn't missed.  Called with interrupts off, from ISRs, so it mustn't
+// touch the RTC compare (see hal_rtc_alarm()).
+static void debounce() {
+    hal_switch_sense(all_mask, SWITCH_SENSE_CHANGE);
+    debounce_sample();
+    sampling = !debounce_idle();
+    hal_sample_timer(sampling);
+    if (sampling) {
+        hal_switch_sense(all_mask, SWITCH_SENSE_NONE);
+        hal_switch_ack(all_mask);
+    }
+}
+
+static inline bool has_passed(uint16_t t, uint16_t now) {
+    return ((int16_t) (now - t)) >= 0;
+}
 
-    // Set all the pins as inputs.
-    SWITCH_PORT.DIRCLR = PIN6_bm;
+static inline bool is_timer_expired(button_t *btn, uint16_t now) {
+    return has_passed(btn->timeout, now);
 }
 
-static inline bool check_timeout(uint16_t t) {
-    return ((int16_t) (RTC.CNT - t)) >= 0;
+
+static inline bool is_short_address(uint8_t addr) {
+    return (addr & 0x81) == 0x01;
+}
+
+static inline bool is_broadcast(uint8_t addr) {
+    return (addr & 0xFC) == 0xFC;
+}
+
+// Bit j set if extraTargets[j] is one of the button's.
+static inline uint8_t extra_targets(button_t *btn) {
+    uint8_t extras = config->extraTargetButtons[btn->index];
+    for (uint8_t j = 0; j < MAX_EXTRA_TARGETS; j++) {
+        if (config->extraTargets[j] == 0xFF) {
+            extras &= ~(1 << j);
+        }
+    }
+    return extras;
+}
+
+static inline uint8_t slot_address(uint8_t slot) {
+    return slot < MAX_BUTTONS ? config->targets[slot] : config->extraTargets[slot - MAX_BUTTONS];
+}
+
+// Address in a target slot, and whether it's one of the button's.
+static bool target_in_slot(button_t *btn, uint8_t slot, uint8_t extras, uint8_t *addr) {
+    *addr = slot_address(slot);
+    if (slot < MAX_BUTTONS) {
+        return slot == btn->index;
+    }
+    return extras & (1 << (slot - MAX_BUTTONS));
 }
 
-static inline bool is_timer_expired(button_t *btn) {
-    return check_timeout(btn->timeout);
+// What eeprom->targetsCheck has to be for what we've learnt about the target slots to still hold.
+static uint8_t targets_check() {
+    uint8_t crc = 0;
+    for (uint8_t slot = 0; slot < NUM_TARGET_SLOTS; slot++) {
+        crc ^= slot_address(slot);
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Forget everything we've learnt about the target slots if they aren't what they were.
+static void check_targets() {
+    const uint8_t check = targets_check();
+    if (eeprom->targetsCheck == check) {
+        return;
+    }
+    const uint8_t unknown = GEAR_INFO_UNKNOWN;
+    const uint16_t groups = GROUPS_UNKNOWN;
+    for (uint8_t slot = 0; slot < NUM_TARGET_SLOTS; slot++) {
+        if (slot < MAX_BUTTONS) {
+            hal_eeprom_write(offsetof(eeprom_t, gear) + slot * sizeof(gear_info_t) + offsetof(gear_info_t, minLevel), &unknown, 1);
+        }
+        hal_eeprom_write(offsetof(eeprom_t, targetGroups) + slot * sizeof(uint16_t), &groups, sizeof(groups));
+    }
+    hal_eeprom_write(offsetof(eeprom_t, targetsCheck), &check, 1);
+}
+
+// Ask the gear at a short address what groups it's in, and keep that.  Nothing answering (or more than one gear)
+// is kept as no groups.
+static uint16_t learn_target_groups(uint8_t slot, uint8_t addr) {
+    uint8_t lo, hi;
+    uint16_t groups = 0;
+    if (send_dali_cmd(addr, DALI_CMD_QUERY_GROUPS_ZERO_TO_SEVEN, &lo) == READ_VALUE
+        && send_dali_cmd(addr, DALI_CMD_QUERY_GROUPS_EIGHT_TO_FIFTEEN, &hi) == READ_VALUE) {
+        groups = (uint16_t) hi << 8 | lo;
+    }
+    hal_eeprom_write(offsetof(eeprom_t, targetGroups) + slot * sizeof(uint16_t), &groups, sizeof(groups));
+    return groups;
 }
 
+// Groups the gear at a short address is in, asking it if we don't know.  0 if it doesn't answer, so that it gets
+// its own frame.
+static uint16_t target_groups(uint8_t slot, uint8_t addr) {
+    uint16_t groups = eeprom->targetGroups[slot];
+    return groups == GROUPS_UNKNOWN ? learn_target_groups(slot, addr) : groups;
+}
 
-static void send_dali_cmd_no_response(button_t *btn, dali_gear_command_t cmd) {
+// Next slot for revalidate_groups().
+static uint8_t revalidate_slot;
+
+// Group membership can change behind our back, and gear that didn't answer can turn up, so ask again.  Only
+// the next slot we have an answer kept for, so that it's a couple of frames each time.
+static void revalidate_groups() {
+    for (uint8_t n = 0; n < NUM_TARGET_SLOTS; n++) {
+        uint8_t slot = revalidate_slot;
+        revalidate_slot = slot + 1 < NUM_TARGET_SLOTS ? slot + 1 : 0;
+        if (eeprom->targetGroups[slot] != GROUPS_UNKNOWN) {
+            learn_target_groups(slot, slot_address(slot));
+            return;
+        }
+    }
+}
+
+// Send a frame to all of a button's targets, with the selector bit (command or DAPC) and data given.  Groups go
+// first, as they're one frame however many gear they reach, then whichever short addresses they don't cover, back to
+// back.
+static void send_to_targets(button_t *btn, uint8_t selector, uint8_t data) {
     uint8_t dummy;
-    read_result_t res = send_dali_cmd(config->targets[btn->index], cmd, &dummy);
-    if (res != READ_NAK) {
-        // What do we do?
+    uint8_t extras = extra_targets(btn);
+    uint16_t groups = 0;
+    uint8_t addr;
+    for (uint8_t slot = 0; slot < NUM_TARGET_SLOTS; slot++) {
+        if (target_in_slot(btn, slot, extras, &addr) && !is_short_address(addr)) {
+            send_dali_cmd((addr & 0xFE) | selector, data, &dummy);
+            if (is_broadcast(addr)) {
+                return;
+            }
+            groups |= (uint16_t) 1 << ((addr >> 1) & 0x0F);
+        }
+    }
+    for (uint8_t slot = 0; slot < NUM_TARGET_SLOTS; slot++) {
+        if (target_in_slot(btn, slot, extras, &addr) && is_short_address(addr)) {
+            if (!groups || !(target_groups(slot, addr) & groups)) {
+                send_dali_cmd((addr & 0xFE) | selector, data, &dummy);
+            }
+        }
+    }
+}
+
+static inline void send_dali_cmd_no_response(button_t *btn, dali_gear_command_t cmd) {
+    send_to_targets(btn, 1, cmd);
+}
+
+static inline void send_arc_level(button_t *btn, uint8_t level) {
+    send_to_targets(btn, 0, level);
+}
+
+static bool send_dali_query(button_t *btn, dali_gear_command_t cmd, uint8_t *val) {
+    return send_dali_cmd(config->targets[btn->index], cmd, val) == READ_VALUE;
+}
+
+
+// Ask the gear for its limits, and keep them in EEPROM.  This takes 4 queries, so is only done the first time
+// they're needed, or after we've seen something that doesn't agree with them.
+static void learn_gear_info(button_t *btn, gear_info_t *info) {
+    if (!send_dali_query(btn, DALI_CMD_QUERY_MIN_LEVEL, &info->minLevel)
+        || !send_dali_query(btn, DALI_CMD_QUERY_MAX_LEVEL, &info->maxLevel)
+        || !send_dali_query(btn, DALI_CMD_QUERY_PHYSICAL_MINIMUM, &info->physicalMinLevel)
+        || !send_dali_query(btn, DALI_CMD_QUERY_FADE_TIME_FADE_RATE, &info->fadeRate)) {
+        // Nobody there, or a group with more than one answer.  Don't ask again until a level query gets an answer.
+        info->minLevel = GEAR_INFO_ABSENT;
+    } else {
+        info->fadeRate &= 0x0F;
+    }
+    hal_eeprom_write(offsetof(eeprom_t, gear) + btn->index * sizeof(gear_info_t), info, sizeof(gear_info_t));
+}
+
+static void forget_gear_info(button_t *btn) {
+    const uint8_t unknown = GEAR_INFO_UNKNOWN;
+    hal_eeprom_write(offsetof(eeprom_t, gear) + btn->index * sizeof(gear_info_t) + offsetof(gear_info_t, minLevel), &unknown, 1);
+}
+
+static inline bool is_gear_info_known(const gear_info_t *info) {
+    return info->minLevel != GEAR_INFO_UNKNOWN && info->minLevel != GEAR_INFO_ABSENT;
+}
+
+// Returns false if we don't know, and couldn't find out.
+static bool get_gear_info(button_t *btn, gear_info_t *info) {
+    *info = eeprom->gear[btn->index];
+    if (info->minLevel == GEAR_INFO_UNKNOWN) {
+        learn_gear_info(btn, info);
     }
+    return is_gear_info_known(info);
 }
 
-static uint8_t send_dali_query(button_t *btn, dali_gear_command_t cmd, uint8_t defaultVal) {
+
+static inline bool is_level_known(button_t *btn) {
+    return btn->level_known;
+}
+
+static inline void set_level(button_t *btn, uint8_t level) {
+    btn->light_level = level;
+    btn->level_known = true;
+    btn->level_time = hal_rtc_now();
+}
+
+// Ask the ballast its current level, and remember it.
+// this takes some time (15-20 ms, including post response delay)
+static void refresh_level(button_t *btn) {
     uint8_t val;
-    read_result_t res = send_dali_cmd(config->targets[btn->index], cmd, &val);
-    if (res != READ_VALUE) {
-        return defaultVal;
+    // If it's off, we can't tell what it'll come back on at, or whether what we remember still holds.
+    btn->last_active = LEVEL_ON_UNKNOWN;
+    if (send_dali_query(btn, DALI_CMD_QUERY_ACTUAL_LEVEL, &val)) {
+        set_level(btn, val);
+        // This is how we find out the gear info is stale (someone has changed the limits, or gear that didn't
+        // answer has turned up).  Learn it again when next needed.
+        const gear_info_t *info = &eeprom->gear[btn->index];
+        if (info->minLevel == GEAR_INFO_ABSENT || (val && is_gear_info_known(info) && (val < info->minLevel || val > info->maxLevel))) {
+            forget_gear_info(btn);
+        }
+    } else {
+        // Nobody answered, so we don't know any more than before.  Treat it as off, and ask again next time.
+        btn->light_level = 0;
+        btn->level_known = false;
     }
-    return val;    
 }
 
 
+static void go_to_last_active_level(button_t *btn) {
+    send_dali_cmd_no_response(btn, DALI_CMD_GO_TO_LAST_ACTIVE_LEVEL);
+    set_level(btn, btn->last_active);
+}
 
 
-static inline void execute_dim(button_t *btn) {
-    send_dali_cmd_no_response(btn,  btn->direction);
+// Erased (or zero, which would make no sense) ramp settings take the default.
+static inline uint8_t ramp_setting(uint8_t value, uint8_t dflt) {
+    return value && value != 0xFF ? value : dflt;
 }
 
+// Time between the steps of a dim.
+static inline uint16_t dim_interval(button_t *btn) {
+    if (btn->ramp_pos == RAMP_NONE) {
+        return config->repeatTimer;
+    }
+    uint8_t interval = ramp_setting(config->rampInterval, DIM_RAMP_INTERVAL_DEFAULT);
+    return interval < DIM_RAMP_INTERVAL_MAX ? interval : DIM_RAMP_INTERVAL_MAX;
+}
 
-static inline void do_press(button_t *btn) {
-    // Its been pressed.
-    btn->state = BTN_STATE_DEBOUNCING;
-    btn->timeout = RTC.CNT + MS_TO_RTC_TICKS(20);
+// One step of a dim.  Along the curve, if we know where we started from, moving so that the whole of the gear's
+// range takes rampTime, and stopping at either end of it.  A step that doesn't change the level isn't sent.
+// Otherwise we leave it to the gear's UP and DOWN, a fade of 200ms at its fade rate.
+static void execute_dim(button_t *btn) {
+    if (btn->ramp_pos == RAMP_NONE) {
+        send_dali_cmd_no_response(btn, btn->direction);
+        // Still on, but we won't know where it ends up until we ask.
+        set_level(btn, LEVEL_ON_UNKNOWN);
+        return;
+    }
+    const gear_info_t *info = &eeprom->gear[btn->index];
+    uint8_t minLevel = is_gear_info_known(info) ? info->minLevel : 1;
+    uint8_t maxLevel = is_gear_info_known(info) ? info->maxLevel : 254;
+    uint16_t lo = dim_position(minLevel);
+    uint16_t hi = dim_position(maxLevel);
+    uint16_t step = (uint32_t) (hi - lo) * dim_interval(btn) / (ramp_setting(config->rampTime, DIM_RAMP_TIME_DEFAULT) * 100U) + 1;
+    uint16_t pos = btn->ramp_pos < lo ? lo : btn->ramp_pos > hi ? hi : btn->ramp_pos;
+    if (btn->direction == DALI_CMD_UP) {
+        pos = hi - pos > step ? pos + step : hi;
+    } else {
+        pos = pos - lo > step ? pos - step : lo;
+    }
+    btn->ramp_pos = pos;
+
+    uint8_t level = dim_level(pos);
+    level = level < minLevel ? minLevel : level > maxLevel ? maxLevel : level;
+    if (level != btn->light_level) {
+        // The steps are a DAPC sequence, so that the gear fades from each to the next rather than at its own fade
+        // time.  One that's just starting, or that lapsed while the level didn't change, has to be (re)enabled.
+        if (!btn->dapc_sequence) {
+            send_dali_cmd_no_response(btn, DALI_CMD_ENABLE_DAPC_SEQUENCE);
+        }
+        send_arc_level(btn, level);
+        set_level(btn, level);
+        btn->dapc_sequence = true;
+    } else {
+        btn->dapc_sequence = false;
+    }
 }
 
-static void debouncing(button_t *btn, const uint8_t button_level) {
-    if (button_level) {
-        // Bounce!  We ignore small pulses (less than the debounce timer) to be noise resistant.
-        btn->state = BTN_STATE_RELEASED;
-    } else if (is_timer_expired(btn)) {
-        // Graduated to pressed. 
-        btn->state = BTN_STATE_PRESSED;
-        btn->timeout = RTC.CNT + config->doublePressTimer;
 
-        // ask the ballast its current level.
-        // this takes some time (15-20 ms, including post response delay)
-        btn->light_level = send_dali_query(btn, DALI_CMD_QUERY_ACTUAL_LEVEL, 0);     
+static inline bool is_press_actuated(button_t *btn) {
+    return config->pressActuation & (1 << btn->index);
+}
+
+// Send out either an off or an on command, depending on the current level
+static void toggle(button_t *btn) {
+    if (btn->light_level) {
+        send_dali_cmd_no_response(btn, DALI_CMD_OFF);
+        btn->last_active = btn->light_level;
+        set_level(btn, 0);
+    } else {
+        go_to_last_active_level(btn);
     }
 }
 
 
-static void released(button_t *btn, const uint8_t button_level) {
-    if (!button_level) {
-        do_press(btn);
+static void released(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_PRESS) {
+        // Its been pressed (and debounced).  How long it's held for counts from when it really went down.
+        btn->state = BTN_STATE_PRESSED;
+        btn->timeout = now + config->doublePressTimer;
+
+        // Only ask the ballast its current level if we don't already know it.
+        if (!is_level_known(btn)) {
+            refresh_level(btn);
+        }
+        // Toggle now, so how quickly the light reacts doesn't depend on how long the button is held.
+        if (is_press_actuated(btn)) {
+            toggle(btn);
+        }
     }
 }
 
-static void pressed(button_t *btn, const uint8_t button_level) {
-    if (button_level) {
-        // Its been released - send out either an off or an on command, depending ont he current level
-        send_dali_cmd_no_response(btn, btn->light_level ? DALI_CMD_OFF : DALI_CMD_GO_TO_LAST_ACTIVE_LEVEL);
-        // The command will have taken a little over 10 milliseconds.  This is effectively our debounce period.
+static void pressed(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_RELEASE) {
+        // Its been released - send out either an off or an on command, depending ont he current level.
+        // Unless we already did it when the button went down.
+        if (!is_press_actuated(btn)) {
+            toggle(btn);
+        }
         btn->state = BTN_STATE_RELEASED;
-    } else if (is_timer_expired(btn)) {
+    } else if (is_timer_expired(btn, now)) {
         btn->state = BTN_STATE_LONGHELD;
-        btn->timeout = RTC.CNT + config->repeatTimer;
         if (btn->light_level == 0) {
-            // We can't dim or brighten if we're not on, so turn it on, and find out what the current level is.
-            send_dali_cmd_no_response(btn, DALI_CMD_GO_TO_LAST_ACTIVE_LEVEL);
-            btn->light_level = send_dali_query(btn, DALI_CMD_QUERY_ACTUAL_LEVEL, 0);     
+            // We can't dim or brighten if we're not on, so turn it on.
+            // If the press turned it off, this puts it back to where it was (it's the last active level).
+            go_to_last_active_level(btn);
+        }
+        // Usually we know the level and the gear's minimum already, so dimming starts with a single frame.
+        gear_info_t info;
+        uint8_t minLevel = get_gear_info(btn, &info) ? info.minLevel : 0;
+        if (btn->light_level == LEVEL_ON_UNKNOWN) {
+            refresh_level(btn);
         }
-        // TODO is there a way this can be hidden something else?  Perhaps during the long press delay?
-        uint8_t minLevel = send_dali_query(btn, DALI_CMD_QUERY_MIN_LEVEL, 0);
         // If we're already at minimum, start out brightening, otherwise start dimming
         btn->direction = btn->light_level <= minLevel ? DALI_CMD_UP : DALI_CMD_DOWN;
+        // Dim along the curve from wherever the light is.  If we couldn't find out where that is (nobody answered,
+        // or it's a group of gear at different levels), leave it to the gear.
+        btn->ramp_pos = btn->level_known && btn->light_level && btn->light_level != LEVEL_ON_UNKNOWN ? dim_position(btn->light_level) : RAMP_NONE;
+        btn->dapc_sequence = false;
+        btn->timeout = now + dim_interval(btn);
         execute_dim(btn);
     }
 }
 
-static void long_pressed(button_t *btn, const uint8_t button_level) {
-    if (button_level) {
-        // It was released. Do some debouncing.
-        btn->state = BTN_STATE_RELEASE_DEBOUNCE;
-        btn->timeout = RTC.CNT + MS_TO_RTC_TICKS(10); 
-    } else if (is_timer_expired(btn)) {
+static void long_pressed(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_RELEASE) {
+        // It was released.  Give it a little while in case it gets pressed again.
+        btn->state = BTN_STATE_RELEASED_WAIT_FOR_REPRESS;
+        btn->timeout = now + config->repeatTimer;
+    } else if (is_timer_expired(btn, now)) {
         // Its been held long enough now for a repeat.
-        btn->timeout = RTC.CNT + config->repeatTimer; 
+        btn->timeout = now + dim_interval(btn);
         execute_dim(btn);
     }
 }
 
-static void release_debounce(button_t *btn, const uint8_t button_level) {
-    if (is_timer_expired(btn)) {
-        btn->state = BTN_STATE_RELEASED_WAIT_FOR_REPRESS;
-        btn->timeout = RTC.CNT + config->repeatTimer;
-    }
-}
-
-static void wait_for_repress(button_t *btn, const uint8_t button_level) {
-    if (!button_level) {
+static void wait_for_repress(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_PRESS) {
         // Its a repress (Kinda like a double click, but after a long hold)
         // TODO If you immediately repress, I wonder if going directly to max (or min) would be a good idea.  An easy way of getting to an extreme without having to wait. 
         btn->direction = btn->direction == DALI_CMD_UP ? DALI_CMD_DOWN : DALI_CMD_UP;
-        btn->timeout = RTC.CNT + config->repeatTimer; 
+        btn->timeout = now + dim_interval(btn);
         btn->state = BTN_STATE_LONGHELD;
+        // It's been a while since the last step.
+        btn->dapc_sequence = false;
         execute_dim(btn);
-    } else if (is_timer_expired(btn)) {
+    } else if (is_timer_expired(btn, now)) {
         btn->state = BTN_STATE_RELEASED;
     }
 }
 
 
-static void poll_button(button_t *btn, uint8_t val) {
+// ------------------------ Input device -------------------------------
+
+// Rather than controlling the gear, the buttons are reported as push button events, and what the light does is up
+// to whatever is listening.  That's one frame per gesture, plus the repeats of a long press, and no queries.
+
+static inline bool is_input_device() {
+    return config->eventScheme != DALI_EVENT_SCHEME_NONE;
+}
+
+static void send_event(button_t *btn, dali_button_event_t event) {
+    send_dali_event(config->eventScheme, config->eventAddress, DALI_INSTANCE_TYPE_PUSH_BUTTON,
+                    config->firstInstance + btn->index, event);
+}
+
+static void event_released(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_PRESS) {
+        btn->state = BTN_STATE_PRESSED;
+        btn->timeout = now + config->doublePressTimer;
+        btn->repressed = false;
+    }
+}
+
+static void event_pressed(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_RELEASE) {
+        if (btn->repressed) {
+            send_event(btn, DALI_EVENT_DOUBLE_PRESS);
+            btn->state = BTN_STATE_RELEASED;
+        } else if (config->shortPressTimer) {
+            // Hold the short press back until we know it isn't the first half of a double press.
+            btn->state = BTN_STATE_RELEASED_WAIT_FOR_REPRESS;
+            btn->timeout = now + config->shortPressTimer;
+        } else {
+            send_event(btn, DALI_EVENT_SHORT_PRESS);
+            btn->state = BTN_STATE_RELEASED;
+        }
+    } else if (is_timer_expired(btn, now)) {
+        btn->state = BTN_STATE_LONGHELD;
+        btn->timeout = now + config->repeatTimer;
+        send_event(btn, DALI_EVENT_LONG_PRESS_START);
+    }
+}
+
+static void event_long_pressed(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_RELEASE) {
+        send_event(btn, DALI_EVENT_LONG_PRESS_STOP);
+        btn->state = BTN_STATE_RELEASED;
+    } else if (is_timer_expired(btn, now)) {
+        btn->timeout = now + config->repeatTimer;
+        send_event(btn, DALI_EVENT_LONG_PRESS_REPEAT);
+    }
+}
+
+static void event_wait_for_repress(button_t *btn, button_event_t event, uint16_t now) {
+    if (event == BTN_EVENT_PRESS) {
+        btn->state = BTN_STATE_PRESSED;
+        btn->timeout = now + config->doublePressTimer;
+        btn->repressed = true;
+    } else if (is_timer_expired(btn, now)) {
+        send_event(btn, DALI_EVENT_SHORT_PRESS);
+        btn->state = BTN_STATE_RELEASED;
+    }
+}
+
+static void poll_event_button(button_t *btn, button_event_t event, uint16_t now) {
     switch (btn->state) {
         case BTN_STATE_RELEASED:
-            released(btn, val);
-            break;
-        case BTN_STATE_DEBOUNCING:
-            debouncing(btn, val);
+            event_released(btn, event, now);
             break;
         case BTN_STATE_PRESSED:
-            pressed(btn, val);
+            event_pressed(btn, event, now);
             break;
         case BTN_STATE_LONGHELD:
-            long_pressed(btn, val);
+            event_long_pressed(btn, event, now);
+            break;
+        case BTN_STATE_RELEASED_WAIT_FOR_REPRESS:
+            event_wait_for_repress(btn, event, now);
+            break;
+        default:
+            // Illegal state.
+            btn->state = BTN_STATE_RELEASED;
+            break;
+    }
+}
+
+
+static void poll_state(button_t *btn, button_event_t event, uint16_t now) {
+    if (is_input_device()) {
+        poll_event_button(btn, event, now);
+        return;
+    }
+    switch (btn->state) {
+        case BTN_STATE_RELEASED:
+            released(btn, event, now);
             break;
-        case BTN_STATE_RELEASE_DEBOUNCE:
-            release_debounce(btn, val);
+        case BTN_STATE_PRESSED:
+            pressed(btn, event, now);
+            break;
+        case BTN_STATE_LONGHELD:
+            long_pressed(btn, event, now);
             break;
         case BTN_STATE_RELEASED_WAIT_FOR_REPRESS:
-            wait_for_repress(btn, val);
+            wait_for_repress(btn, event, now);
             break;
         default:
             // Illegal state.
@@ -230,57 +665,167 @@ static void poll_button(button_t *btn, uint8_t val) {
     }
 }
 
+static inline void poll_button(button_t *btn, button_event_t event, uint16_t now) {
+#ifdef TRACE
+    const button_state_t was = btn->state;
+    poll_state(btn, event, now);
+    if (btn->state != was) {
+        TRACE_POINT(TRACE_STATE, btn->index << 4 | btn->state);
+    }
+#else
+    poll_state(btn, event, now);
+#endif
+}
+
 
+// Handle whatever the buttons have done since last time.
+void poll_buttons() {
+    // Forget any light levels we've kept for too long, before anything relies on them.
+    uint16_t now = hal_rtc_now();
+    bool stale = false;
+    for  (button_t *btn = buttons; btn < (buttons+num_buttons); btn++) {
+        if (btn->level_known && (uint16_t) (now - btn->level_time) >= LEVEL_MAX_AGE_TICKS) {
+            btn->level_known = false;
+            stale = true;
+        }
+    }
 
-bool poll_buttons() {
-    bool all_idle = true;
+    // Work through what the debouncer has seen since last time, in the order it happened.  Each change is handled
+    // as of when it happened rather than when we got to it, so being busy on the bus doesn't change what a
+    // gesture turns out to be.  Anything that timed out before the change did so first.
+    while (event_tail != event_head) {
+        const input_event_t *ev = &event_queue[event_tail & (EVENT_QUEUE_SIZE - 1)];
+        for  (button_t *btn = buttons; btn < (buttons+num_buttons); btn++) {
+            if (btn->mask == ev->mask) {
+                if (btn->state != BTN_STATE_RELEASED) {
+                    poll_button(btn, BTN_EVENT_NONE, ev->at);
+                }
+                poll_button(btn, ev->event, ev->at);
+            }
+        }
+        event_tail++;
+    }
 
-    for  (button_t *btn = buttons; btn < (buttons+NUM_BUTTONS); btn++) {
-        uint8_t val = SWITCH_PORT.IN & btn->mask;
-        poll_button(btn, val);
+    now = hal_rtc_now();
+    bool busy = false;
+    for  (button_t *btn = buttons; btn < (buttons+num_buttons); btn++) {
+        // Nothing to do for a button that isn't being touched, which is most of them most of the time.
         if (btn->state != BTN_STATE_RELEASED) {
-            all_idle = false;
+            poll_button(btn, BTN_EVENT_NONE, now);
+            busy = true;
         }
-        wdt_reset();
-    }
-    // If nothing happens for 1/2 second once we return to an all-idle state, sleep.
-    // This is needed to deal with debouncing during press.
-    if (all_idle) {
-        switch (sleepState) {
-            case SLEEP_STATE_SLEEP_READY:
-                return true;
-
-            case SLEEP_STATE_WAITING:
-                if (check_timeout(idleTimeout)) {
-                    sleepState = SLEEP_STATE_SLEEP_READY;
-                }
-            break;
+    }
+    // We wake up for levels going stale, so that's usually with nothing else going on.  If something is, it can
+    // wait for the next one.
+    if (stale && !busy) {
+        revalidate_groups();
+    }
+    wdt_reset();
+}
 
-            case SLEEP_STATE_PROCESSING:
-                sleepState = SLEEP_STATE_WAITING;
-                idleTimeout = RTC.CNT + MS_TO_RTC_TICKS(500); 
-            break;
+
+static inline void sooner(uint16_t *soonest, uint16_t t, uint16_t now) {
+    int16_t left = t - now;
+    if (left < 0) {
+        left = 0;
+    }
+    if ((uint16_t) left < *soonest) {
+        *soonest = left;
+    }
+}
+
+// Ticks until the soonest of the buttons' timeouts (0 if one has already passed), or 0xFFFF if none of them has one.
+static uint16_t ticks_to_deadline(uint16_t now) {
+    uint16_t soonest = 0xFFFF;
+    for  (button_t *btn = buttons; btn < (buttons+num_buttons); btn++) {
+        if (btn->state != BTN_STATE_RELEASED) {
+            sooner(&soonest, btn->timeout, now);
+        }
+    }
+    return soonest;
+}
+
+// Same for the cached light levels going stale.  These are further off than an int16_t can reach.
+static uint16_t ticks_to_level_expiry(uint16_t now) {
+    uint16_t soonest = 0xFFFF;
+    for  (button_t *btn = buttons; btn < (buttons+num_buttons); btn++) {
+        if (btn->level_known) {
+            uint16_t age = now - btn->level_time;
+            uint16_t left = age < LEVEL_MAX_AGE_TICKS ? LEVEL_MAX_AGE_TICKS - age : 0;
+            if (left < soonest) {
+                soonest = left;
+            }
         }
+    }
+    return soonest;
+}
+
+
+// Sleep until there's something for poll_buttons() to do.  Nothing happens between the deadlines of a button
+// that's being handled except for the inputs changing, so we doze with RTC.CMP set to the soonest one.  Once
+// they're all idle, all that's left is a cached light level going stale, which can be a minute away.  After that
+// only a press matters, and we power down with nothing running at all.
+void buttons_sleep() {
+    if (!sampling && ticks_to_deadline(hal_rtc_now()) == 0xFFFF) {
+        // None of the buttons has anything to do, so this is the time for anything that would get in the way
+        // of one.  With interrupts on, as it can take a while.  A press in the meantime is in the queue below.
+        TRACE_FLUSH();
+        perf_idle();
+    }
+    cli();
+    if (event_tail != event_head) {
+        // The debouncer has seen something since the poll.
+        sei();
+        return;
+    }
+    if (sampling) {
+        // The PIT wakes us for the next sample, which is sooner than any deadline.
+        power_sleep(POWER_DOZE);
+        return;
+    }
+    uint16_t now = hal_rtc_now();
+    power_sleep_t sleep = POWER_DOZE;
+    uint16_t left = ticks_to_deadline(now);
+    if (left == 0xFFFF) {
+        sleep = POWER_WAIT;
+        left = ticks_to_level_expiry(now);
+    }
+    if (left < MIN_SLEEP_TICKS) {
+        sei();
+        return;
+    }
+    if (left == 0xFFFF) {
+        hal_rtc_alarm_off();
+        hal_switch_sense(all_mask, SWITCH_SENSE_WAKE);
+        sleep = POWER_OFF;
     } else {
-        sleepState = SLEEP_STATE_PROCESSING;
+        hal_rtc_alarm(now + left);
     }
-    return false;
+    power_sleep(sleep);
 }
 
 
-// This is called if a button was pressed while sleeping (the normal entry to a button being pressed)
+// A button changed (or was pressed while we were powered down).  Start debouncing it.  This also turns off the
+// low level interrupt, which would keep firing while the button is held.
 ISR(PORTA_PORT_vect) {
-    // Turn off all interrupts, as we're going back to polling.
-    PORTA.PIN6CTRL = PORT_PULLUPEN_bm;
-
-    // We know the button was pressed, and that all buttons must have been idle beforehand.
-    uint8_t processed = 0x00;
-    for  (button_t *btn = buttons; btn < (buttons+NUM_BUTTONS); btn++) {
-        if (PORTA.INTFLAGS & btn->mask) {
-            processed |= btn->mask;
-            do_press(btn);
-        }
-    }
-    // Acknowledge the processed interrupts. 
-    PORTA.INTFLAGS = processed;
+    const uint8_t pending = hal_switch_pending();
+    power_woken(PERF_WAKE_PIN);
+    TRACE_POINT(TRACE_PIN, pending);
+    hal_switch_ack(pending);
+    debounce();
+}
+
+
+// A button's deadline, which only has to wake us up.
+ISR(RTC_CNT_vect) {
+    power_woken(PERF_WAKE_RTC);
+    hal_rtc_alarm_off();
+}
+
+
+// The next debounce sample.  Being an interrupt, sampling carries on while we're busy on the bus, so the debounce
+// timing doesn't depend on how often we get to poll.
+ISR(RTC_PIT_vect) {
+    power_woken(PERF_WAKE_RTC);
+    debounce();
 }
\ No newline at end of file
@@ -1,9 +1,14 @@
 #ifndef __BUTTONS_H__
 #define __BUTTONS_H__
 
-#define NUM_BUTTONS (1)
+// One button per config->targets.
+#define MAX_BUTTONS (5)
+
+// Pin of each button on SWITCH_PORT, for the test board.
+#define BUTTON_PINS { PIN6_bm, PIN5_bm, PIN4_bm, PIN3_bm, PIN2_bm }
 
 extern void buttons_init();
-bool poll_buttons();
+void poll_buttons();
+void buttons_sleep();
 
 #endif
\ No newline at end of file
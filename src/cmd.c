@@ -2,19 +2,15 @@
 
 
 
-#include <avr/io.h>
-#include <util/delay.h>
 #include <inttypes.h>
-#include <avr/interrupt.h>
-#include <avr/sleep.h>
-#include <avr/pgmspace.h>
-#include <avr/wdt.h>
-#include <util/atomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include "config.h"
 #include "cmd.h"
+#include "hal.h"
+#include "perf.h"
+#include "trace.h"
 
 typedef enum {
     PULSE_HALF,
@@ -23,76 +19,152 @@ typedef enum {
 } pulse_t;
 
 
+// Settling time (in PHY clock ticks) that applies to the next forward frame, which depends on what the
+// last frame on the bus was.  The PHY clock tells us how long ago that was.
+static uint16_t settling_time = USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY2_USEC);
 
-static inline void write_one() {
-    PORTB.OUTSET = PORT_INT2_bm;
-    _delay_us(DALI_HALF_BIT_USECS);
-    PORTB.OUTTGL = PORT_INT2_bm;
-    _delay_us(DALI_HALF_BIT_USECS);
+// For backing off after a collision.  Seeded on first use, and never 0.
+static uint16_t random_state;
+
+
+
+// Pre-encode a forward frame (start bit, address, command) into the left aligned format used by the PHY
+static inline uint32_t encode_forward_frame(uint8_t addr, uint8_t cmd) {
+    return ((uint32_t) (0x10000 | ((uint16_t) addr << 8) | cmd)) << (32 - 17);
 }
 
-static inline void write_zero() {
-    PORTB.OUTCLR = PORT_INT2_bm;
-    _delay_us(DALI_HALF_BIT_USECS);
-    PORTB.OUTTGL = PORT_INT2_bm;
-    _delay_us(DALI_HALF_BIT_USECS);
+// Same for a 24 bit event frame.  The first byte says who sent it, and the top 6 bits of the rest say which
+// instance (or which type of instance), leaving 10 bits of event information.  Bit 16 is clear for an event.
+static uint32_t encode_event_frame(dali_event_scheme_t scheme, uint8_t addr, uint8_t type, uint8_t instance, uint16_t info) {
+    uint8_t source;
+    uint8_t which;
+    switch (scheme) {
+        case DALI_EVENT_SCHEME_INSTANCE:
+            source = 0x80 | (type & 0x1F) << 1;
+            which = 0x80 | (instance & 0x1F) << 2;
+            break;
+        case DALI_EVENT_SCHEME_DEVICE_INSTANCE:
+            source = (addr & 0x3F) << 1;
+            which = 0x80 | (instance & 0x1F) << 2;
+            break;
+        case DALI_EVENT_SCHEME_DEVICE_GROUP:
+            source = 0x80 | (addr & 0x1F) << 1;
+            which = (type & 0x1F) << 2;
+            break;
+        case DALI_EVENT_SCHEME_INSTANCE_GROUP:
+            source = 0xC0 | (addr & 0x1F) << 1;
+            which = (type & 0x1F) << 2;
+            break;
+        default:
+            source = (addr & 0x3F) << 1;
+            which = (type & 0x1F) << 2;
+            break;
+    }
+    which |= (info >> 8) & 0x03;
+    return (0x1000000UL | (uint32_t) source << 16 | (uint16_t) which << 8 | (info & 0xFF)) << (32 - 25);
 }
 
 
-static inline void write_byte(uint8_t byte) 
-{
-    for (uint8_t i = 0; i < 8; i++) {
-        // Load constant 8 into one register (ldi r1,8)
-        // load byte into another (ldi r2,??)
-        // startasm lsl - Top bit goes into carry (lcs)
-        // jump if carry is one to write one (brcs)
-        // set output high (start a zero)
-        // jump past next statement
-        // set output to low
-        // delay half bit
-        // toggle
-        // delay half bit
-        // decrement count register
-        // jump back to loop start if count register is not 0.
+// The backward frame settling time only holds straight after our own transaction.  Once somebody else has had the
+// bus we're back to a forward frame's.
+static inline uint16_t forward_settling(uint16_t settling) {
+    return settling < USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY1_USEC) ? USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY2_USEC) : settling;
+}
 
-        //write each bit 1 at a time.
-        // TODO can we replace this with a shift less plus an output flag?
-        if (byte & 0x80) {
-            write_one();
-        } else {
-            write_zero();
-        }
-        byte <<= 1;
+
+// Sleep until the earliest time the next forward frame is allowed on the bus, listening as we go.  Returns false if
+// somebody else started a frame in the meantime.
+// The comparator is off after a sleep, so we've no idea what the bus has been doing.  Somebody could be part way
+// through a frame, or have just sent a query whose answer is yet to come.  So once the comparator is up, the bus has
+// to stay idle for the response window plus a forward frame's settling time before we can call it free.  That
+// covers any settling time we know of.
+static bool wait_for_bus() {
+    if (phy_power_up()) {
+        phy_wait(USEC_TO_PHY_TICKS(PHY_POWER_UP_USEC) + 1, false);
+        return phy_bus_idle() && phy_wait(USEC_TO_PHY_TICKS(DALI_RESPONSE_MAX_DELAY_USEC) + forward_settling(settling_time), true);
     }
+    uint16_t since = phy_since_frame_end();
+    return since >= settling_time || phy_wait(settling_time - since, true);
 }
 
-static read_result_t dali_write(uint8_t addr, uint8_t cmd) {
-    // Check that line is high (and has been for some time?)
-    // for each bit, drive low then high, or vice versa.
-    if ((AC0.STATUS & AC_STATE_bm) == 0) {
-        return READ_COLLISION;
+
+// Whether anything could answer this frame.  Only queries are answered, plus some of the special
+// commands used for commissioning, which we don't try to tell apart.
+static inline bool expects_reply(uint8_t addr, uint8_t cmd) {
+    if (addr >= 0xA0 && addr < 0xFC) {
+        return true;
     }
+    return (addr & 0x01) && cmd >= DALI_CMD_QUERY_STATUS;
+}
+
+
+// xorshift
+static uint16_t random16() {
+    uint16_t x = random_state ? random_state : hal_seed() | 1;
+    x ^= x << 7;
+    x ^= x >> 9;
+    x ^= x << 8;
+    random_state = x;
+    return x;
+}
 
-    // Write the start bit
-    write_one();
-    write_byte(addr);
-    write_byte(cmd);
-    
-    PORTB.OUTCLR = PORT_INT2_bm;
-    return READ_NAK;
+
+// Somebody else is part way through a frame.  Listen until it's over, so that the PHY clock (and our settling
+// time) starts from its end.  Anything we pick up is of no interest.
+static void wait_for_frame_end() {
+    uint16_t edges[PHY_MAX_EDGES];
+    phy_receive(USEC_TO_TICKS(DALI_BIT_USECS * 2), edges);
+    settling_time = forward_settling(settling_time);
 }
 
 
-static pulse_t read_pulse() {
-    uint8_t lvl = AC0.STATUS & AC_STATE_bm;
-    uint16_t t = 0;
-    while ((AC0.STATUS & AC_STATE_bm) == lvl) {
-        t = TCA0.SINGLE.CNT;
-        if (t > USEC_TO_TICKS(DALI_BIT_USECS + DALI_MARGIN_USECS)) {
-            return INVALID;
+// Send a frame, trying again if it collides.  If somebody else starts a frame before we do, we follow it to its end
+// and wait from there, which doesn't count as an attempt.  Either way we then wait for a random point in the
+// settling window of the frame's priority, so that whoever else was waiting (who does the same) most likely goes
+// first, or second, but not at the same time.  DALI_MAX_ATTEMPTS and DALI_MAX_DEFERRALS keep a bus that's jammed
+// from holding us up for long.  When they run out the frame is given up on, rather than sent into somebody else's.
+static read_result_t dali_write_frame(uint32_t frame, uint8_t nbits) {
+    const uint16_t settling = settling_time;
+    uint8_t attempts = 0;
+    uint8_t deferrals = 0;
+    TRACE_POINT(TRACE_WRITE, 0);
+    for (;;) {
+        if (!(wait_for_bus() && phy_bus_idle())) {
+            wait_for_frame_end();
+            if (++deferrals > DALI_MAX_DEFERRALS) {
+                perf.dali.dropped++;
+                TRACE_POINT(TRACE_WRITE_END, READ_COLLISION);
+                return READ_COLLISION;
+            }
+            perf.dali.deferrals++;
+        } else {
+            TRACE_POINT(TRACE_TX, attempts);
+            // The frame is clocked out by a timer, and we sleep in between half bits.
+            if (phy_transmit(frame, nbits)) {
+                perf.dali.frames++;
+                settling_time = settling;
+                TRACE_POINT(TRACE_WRITE_END, READ_NAK);
+                return READ_NAK;
+            }
+            perf.dali.collisions++;
+            if (++attempts >= DALI_MAX_ATTEMPTS) {
+                perf.dali.dropped++;
+                settling_time = forward_settling(settling);
+                TRACE_POINT(TRACE_WRITE_END, READ_COLLISION);
+                return READ_COLLISION;
+            }
+            perf.dali.retries++;
         }
+        settling_time = forward_settling(settling) + random16() % (USEC_TO_PHY_TICKS(DALI_SETTLING_WINDOW_USEC) + 1);
     }
-    TCA0.SINGLE.CNT = 0;
+}
+
+static inline read_result_t dali_write(uint8_t addr, uint8_t cmd) {
+    return dali_write_frame(encode_forward_frame(addr, cmd), 17);
+}
+
+
+static pulse_t classify_pulse(uint16_t t) {
     if (t < USEC_TO_TICKS(DALI_HALF_BIT_USECS - DALI_MARGIN_USECS)) {
         return INVALID;
     }
@@ -102,73 +174,84 @@ static pulse_t read_pulse() {
     if (t < USEC_TO_TICKS(DALI_BIT_USECS - DALI_MARGIN_USECS)) {
         return INVALID;
     }
-    return PULSE_FULL;
+    if (t < USEC_TO_TICKS(DALI_BIT_USECS + DALI_MARGIN_USECS)) {
+        return PULSE_FULL;
+    }
+    return INVALID;
 }
 
-    
-static read_result_t dali_read(uint16_t timeout, uint8_t *out) {
-    // disable interrupts. but why?
-    // ensure line is high
-    read_result_t result = READ_COLLISION;
-    
-    // Start TCA0, counting from 0, no interrupts, no fancy resetting.
-    TCA0.SINGLE.CNT = 0;
-    TCA0.SINGLE.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm; // start the clock
-
-    // Wait for line to go low - record when this happened, then restart the clock
-    while (AC0.STATUS & AC_STATE_bm) {
-        if (TCA0.SINGLE.CNT >= timeout) {
-            // Nothing received within timeout period.
-            result = READ_NAK;
-            goto cleanup;
-        } 
-    }
-    TCA0.SINGLE.CNT = 0; // reset counting for the bit widths.
-    // Read the first half of the start bit.
-    if (read_pulse() != PULSE_HALF) {
-        goto cleanup;
-    }
-
-    // We're now half way through the start bit.  Start reading pulses
+
+// Width of the i'th pulse (the time between edge i and i+1), classified.
+static inline pulse_t pulse_at(const uint16_t *edges, uint8_t i) {
+    return classify_pulse(edges[i+1] - edges[i]);
+}
+
+
+// Decode a backward frame from its edge timestamps, after the frame has finished.
+// Any pulse that is off the half/full bit grid, or a line left low, can only come from more than
+// one transmitter, so is reported as a collision.  Pulses that are all legal widths but don't form a
+// valid start bit plus 8 bits are a Manchester violation.
+static read_result_t decode_backward_frame(const uint16_t *edges, uint8_t count, uint8_t *out) {
+    // An odd number of edges means that somebody is still holding the line low.
+    if (count > PHY_MAX_EDGES || (count & 1)) {
+        return READ_COLLISION;
+    }
+    uint8_t npulses = count - 1;
+    for (uint8_t i = 0; i < npulses; i++) {
+        if (pulse_at(edges, i) == INVALID) {
+            return READ_COLLISION;
+        }
+    }
+
+    // The first pulse is the first half of the start bit, which leaves us half way through it.
+    if (pulse_at(edges, 0) != PULSE_HALF) {
+        return READ_MANCHESTER_ERROR;
+    }
+    uint8_t i = 1;
     uint8_t val = 0;
     uint8_t last = 1;
-    for (uint8_t i = 0; i < 8; i++) {
-        switch (read_pulse()) {
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        if (i >= npulses) {
+            return READ_MANCHESTER_ERROR;
+        }
+        switch (pulse_at(edges, i++)) {
             case PULSE_HALF:
                 // We immediately expect another half pulse to take us back to the half bit, meaning we have a bit the same as the last one
-                if (read_pulse() != PULSE_HALF) {
-                    goto cleanup;
+                if (i >= npulses || pulse_at(edges, i++) != PULSE_HALF) {
+                    return READ_MANCHESTER_ERROR;
                 }
                 break;
-            case PULSE_FULL:
+            default:
                 // Its a bit flip
                 last = !last;
                 break;
-            default:
-                goto cleanup;
         }
         val = val << 1 | last;
     }
     if (last == 0) {
-        // We finished with a 0, which drives the line high, then low.  Read one last pulse in
-        if (read_pulse() != PULSE_HALF) {
-            goto cleanup;
+        // We finished with a 0, which drives the line high, then low.  There should be one last half pulse.
+        if (i >= npulses || pulse_at(edges, i++) != PULSE_HALF) {
+            return READ_MANCHESTER_ERROR;
         }
     }
-    
-    // For cleanliness' sake, we expect the bus to remain high for 2 bit periods after end
-    while (TCA0.SINGLE.CNT < USEC_TO_TICKS(DALI_BIT_USECS*2)) {
-        if ((AC0.STATUS & AC_STATE_bm) == 0) {
-            goto cleanup;
-        }
+    // Anything left over is not part of a valid frame.
+    if (i != npulses) {
+        return READ_MANCHESTER_ERROR;
     }
-    result = READ_VALUE;
     *out = val;
-cleanup:
-    // Stop TCA0
-    // re-enable interrupts
-    TCA0.SINGLE.CTRLA = 0;
-    return result;
+    return READ_VALUE;
+}
+
+
+static read_result_t dali_read(uint16_t timeout, uint8_t *out) {
+    uint16_t edges[PHY_MAX_EDGES];
+    TRACE_POINT(TRACE_READ, 0);
+    uint8_t count = phy_receive(timeout, edges);
+    // Nothing received within timeout period is a NAK.
+    read_result_t res = count ? decode_backward_frame(edges, count, out) : READ_NAK;
+    perf.dali.replies[res]++;
+    TRACE_POINT(TRACE_READ_END, res);
+    return res;
 }
 
 
@@ -177,16 +260,47 @@ read_result_t send_dali_cmd(uint8_t addr, dali_gear_command_t cmd, uint8_t *out)
     if (res != READ_NAK) {
         return res;
     }
+    // Our frame is the last thing on the bus, unless someone answers.  The forward frame settling time
+    // is longer than the response window, so if nobody is going to answer there's no need to listen,
+    // and the next frame will wait for the settling time anyway.
+    settling_time = USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY2_USEC);
+    if (!expects_reply(addr, cmd)) {
+        return READ_NAK;
+    }
     // Give the line a chance to recover after transmitting before we start reading
     // There might be some propagation delay.
     _delay_us(10);
     res =  dali_read(USEC_TO_TICKS(DALI_RESPONSE_MAX_DELAY_USEC), out);
 
-    // if a response was received, we can't transmit again for another 22 half bits (9.17ms)
-    // Technically, we could set up a timer to go off after this time, but there's not really
-    // much we can do during this time anyway, so we just delay here. 
+    // If an answer came back, the next frame can follow it much sooner than it could our forward frame.
+    // The PHY clock starts at the last edge, but a frame ending in a 1 ends half a bit later than that.
+    // Anything else is most likely somebody else's forward frame, or answers colliding and a break, so the
+    // next frame waits for a forward frame's settling time, at a random point in the window as after a collision.
     if (res == READ_VALUE) {
-        _delay_us(DALI_RESPONSE_MAX_DELAY_USEC);
+        settling_time = USEC_TO_PHY_TICKS(DALI_SETTLING_BACKWARD_USEC) + (*out & 1 ? USEC_TO_PHY_TICKS(DALI_HALF_BIT_USECS) : 0);
+    } else if (res != READ_NAK) {
+        settling_time = forward_settling(settling_time) + random16() % (USEC_TO_PHY_TICKS(DALI_SETTLING_WINDOW_USEC) + 1);
     }
     return res;
 }
+
+
+read_result_t send_dali_cmd_twice(uint8_t addr, dali_gear_command_t cmd) {
+    read_result_t res = dali_write(addr, cmd);
+    if (res != READ_NAK) {
+        return res;
+    }
+    // The repeat goes out at priority 1, well inside DALI_SEND_TWICE_MAX_USEC.  Nothing answers a send twice command.
+    settling_time = USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY1_USEC);
+    res = dali_write(addr, cmd);
+    settling_time = USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY2_USEC);
+    return res;
+}
+
+
+// Events go out at priority 2, the same as our commands.
+read_result_t send_dali_event(dali_event_scheme_t scheme, uint8_t addr, uint8_t type, uint8_t instance, uint16_t info) {
+    read_result_t res = dali_write_frame(encode_event_frame(scheme, addr, type, instance, info), 25);
+    settling_time = USEC_TO_PHY_TICKS(DALI_SETTLING_PRIORITY2_USEC);
+    return res;
+}
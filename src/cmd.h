@@ -7,7 +7,10 @@
 typedef enum {
     READ_VALUE,
     READ_NAK,
+    // Edges off the bit grid, or the line held low - more than one device transmitting.
     READ_COLLISION,
+    // Legal pulse widths, but not a valid Manchester encoded backward frame.
+    READ_MANCHESTER_ERROR,
 } read_result_t;
 
 
@@ -87,7 +90,63 @@ typedef enum {
 
 
 
+// How an input device (IEC 62386-103) says where an event came from, which is set per device.
+typedef enum {
+    // Instance type + instance number
+    DALI_EVENT_SCHEME_INSTANCE,
+    // Short address + instance type
+    DALI_EVENT_SCHEME_DEVICE,
+    // Short address + instance number
+    DALI_EVENT_SCHEME_DEVICE_INSTANCE,
+    // Device group + instance type
+    DALI_EVENT_SCHEME_DEVICE_GROUP,
+    // Instance group + instance type
+    DALI_EVENT_SCHEME_INSTANCE_GROUP,
+    // Not an input device.  We send commands to the gear ourselves.
+    DALI_EVENT_SCHEME_NONE = 0xFF,
+} dali_event_scheme_t;
+
+#define DALI_INSTANCE_TYPE_PUSH_BUTTON (1)
+
+// Push button events (IEC 62386-301)
+typedef enum {
+    DALI_EVENT_BUTTON_RELEASED = 0x00,
+    DALI_EVENT_BUTTON_PRESSED = 0x01,
+    DALI_EVENT_SHORT_PRESS = 0x02,
+    DALI_EVENT_DOUBLE_PRESS = 0x05,
+    DALI_EVENT_LONG_PRESS_START = 0x09,
+    DALI_EVENT_LONG_PRESS_REPEAT = 0x0B,
+    DALI_EVENT_LONG_PRESS_STOP = 0x0C,
+} dali_button_event_t;
+
+
+#define READ_RESULTS (READ_MANCHESTER_ERROR + 1)
+
+// How we're getting on with the bus.  Part of the lifetime counters in perf.h.  Counts wrap.
+typedef struct {
+    // Forward frames that went out without a collision
+    uint32_t frames;
+    // Frames that collided with another transmitter
+    uint32_t collisions;
+    // Frames that were tried again after a collision
+    uint32_t retries;
+    // Frames given up on after DALI_MAX_ATTEMPTS, or DALI_MAX_DEFERRALS
+    uint32_t dropped;
+    // Times somebody else started a frame before we could start ours
+    uint32_t deferrals;
+    // How each wait for a reply turned out, by read_result_t: a backward frame, nothing (NAK), several gear
+    // answering at once, or a Manchester error.
+    uint32_t replies[READ_RESULTS];
+} dali_stats_t;
+
+
 read_result_t send_dali_cmd(uint8_t addr, dali_gear_command_t cmd, uint8_t *out);
+// Configuration commands (0x20 - 0x81) only take effect if they are received twice in a row.
+read_result_t send_dali_cmd_twice(uint8_t addr, dali_gear_command_t cmd);
+
+// Send an input device event as a 24 bit frame.  addr is the short address, device group or instance group,
+// depending on the scheme, and whichever of type and instance the scheme doesn't use is ignored.  Nothing answers.
+read_result_t send_dali_event(dali_event_scheme_t scheme, uint8_t addr, uint8_t type, uint8_t instance, uint16_t info);
 
 
 #endif
\ No newline at end of file
@@ -2,20 +2,86 @@
 #define __CONFIG_H__
 #include <stdbool.h>
 #include <stdint.h>
-#include <avr/eeprom.h>
-#include <stdbool.h>
+#include "hal.h"
+#include "perf.h"
+#include "update.h"
+
+// The main clock is the 20MHz oscillator through the prescaler, which is changed on the fly.  We run at F_CPU (the
+// fast clock), and only drop to the slow clock while idling with a timer doing the work: transmitting, and waiting
+// for the bus to settle.  The oscillator draws the same whatever the prescaler, so anything that is counting cycles
+// is done quicker, and for less, at the fast clock.  Receiving stays at F_CPU for the capture resolution.
+// Both have to be a prescaler setting (2, 4, 8, 16, 32, 64, 6, 10, 12, 24, 48).
+#define CLOCK_OSC_HZ        (20000000UL)
+#define CLOCK_FAST_DIV      (6)
+#define CLOCK_SLOW_DIV      (48)
+#define CLOCK_HZ(div)       (CLOCK_OSC_HZ / (div))
 
 #define DALI_BAUD           (1200)
 #define DALI_BIT_USECS      (1000000.0/DALI_BAUD)
 #define DALI_HALF_BIT_USECS (DALI_BIT_USECS/2.0)
 #define DALI_MARGIN_USECS   (45)
-#define USEC_TO_TICKS(u)    ((uint16_t) (((float)u)*(F_CPU/1000000.0) + 0.5))
+// CPU ticks at a given clock.  Without one, at F_CPU, which is what TCB0 counts while receiving.
+#define USEC_TO_TICKS_AT(u, hz) ((uint16_t) (((float)u)*((hz)/1000000.0) + 0.5))
+#define USEC_TO_TICKS(u)    USEC_TO_TICKS_AT(u, F_CPU)
 #define MSEC_TO_TICKS(u)    USEC_TO_TICKS((u)*1000)
 #define TICKS_TO_USECS(u)   (uint16_t) ((u)/(F_CPU/1000000.0))
 
+// The PHY clock ticks at the same rate on either clock.  On the slow clock TCA0 divides by this instead.
+#define USEC_TO_PHY_TICKS(u) ((uint16_t) (((float)u)*(F_CPU/PHY_CLOCK_DIV/1000000.0) + 0.5))
+#define PHY_CLOCK_SLOW_DIV  (PHY_CLOCK_DIV * CLOCK_FAST_DIV / CLOCK_SLOW_DIV)
+
+// TCA0 ticks per half bit, and per collision break, while transmitting.
+#define TX_HALF_BIT_TICKS   USEC_TO_TICKS_AT(DALI_HALF_BIT_USECS, CLOCK_HZ(CLOCK_SLOW_DIV))
+#define TX_BREAK_TICKS      USEC_TO_TICKS_AT(DALI_BREAK_USEC, CLOCK_HZ(CLOCK_SLOW_DIV))
+
 // Reponse delay is 22 half bits, or 9.17 msec
 #define DALI_RESPONSE_MAX_DELAY_USEC (22 * DALI_HALF_BIT_USECS)
 
+// DALI-2 settling times (IEC 62386-101), from the end of the last frame on the bus until the next forward frame may start.
+// After a backward frame
+#define DALI_SETTLING_BACKWARD_USEC     (2400)
+// After a forward frame, for the second frame of a send twice command (priority 1)
+#define DALI_SETTLING_PRIORITY1_USEC    (13500)
+// After a forward frame, for user instigated actions (priority 2), which is everything else we send
+#define DALI_SETTLING_PRIORITY2_USEC    (14900)
+// Both frames of a send twice command have to arrive within this long of each other.
+#define DALI_SEND_TWICE_MAX_USEC        (100000)
+// After ENABLE DAPC SEQUENCE (IEC 62386-102), each DAPC has to follow the last within this long for the gear to
+// fade smoothly from one to the next.  The sequence ends if one doesn't.
+#define DALI_DAPC_SEQUENCE_MS           (200)
+// Each priority's settling time is a window this wide (for priorities 1 and 2), starting at the times above.
+// Transmitters that collide retry at random points in it, so that they don't collide again.
+#define DALI_SETTLING_WINDOW_USEC       (1200)
+// How long a transmitter that detects a collision holds the bus low for, to make sure the others detect it too.
+#define DALI_BREAK_USEC                 (1300)
+// Attempts at a frame before giving up on it, if it keeps colliding.
+#define DALI_MAX_ATTEMPTS               (4)
+// Frames from other transmitters we'll let go ahead of one of ours before giving up on it.
+#define DALI_MAX_DEFERRALS              (32)
+
+// Check the timing works out at the clocks we've picked.  The counts have to fit the 16 bit timers, and the receive
+// margin has to be enough ticks that classifying pulses isn't thrown by a tick either way.
+_Static_assert(CLOCK_HZ(CLOCK_FAST_DIV) == F_CPU, "F_CPU has to be the fast clock");
+_Static_assert((unsigned long) (DALI_RESPONSE_MAX_DELAY_USEC * (F_CPU / 1000000.0)) < 65536, "Response window doesn't fit TCA0 at F_CPU");
+_Static_assert((unsigned long) (DALI_BIT_USECS * 2 * (F_CPU / 1000000.0)) < 65536, "End of frame timeout doesn't fit TCA0 at F_CPU");
+_Static_assert((unsigned long) (DALI_MARGIN_USECS * (F_CPU / 1000000.0)) >= 16, "F_CPU is too slow to time backward frames");
+_Static_assert((unsigned long) (PHY_CLOCK_MAX_USEC * (F_CPU / PHY_CLOCK_DIV / 1000000.0)) < 65536, "PHY clock doesn't fit TCA0");
+_Static_assert(TX_HALF_BIT_TICKS * 1000000.0 / CLOCK_HZ(CLOCK_SLOW_DIV) > DALI_HALF_BIT_USECS * 0.99 &&
+               TX_HALF_BIT_TICKS * 1000000.0 / CLOCK_HZ(CLOCK_SLOW_DIV) < DALI_HALF_BIT_USECS * 1.01,
+               "Half bits are more than 1% out at the slow clock");
+_Static_assert(CLOCK_SLOW_DIV % CLOCK_FAST_DIV == 0 && PHY_CLOCK_SLOW_DIV * CLOCK_SLOW_DIV == PHY_CLOCK_DIV * CLOCK_FAST_DIV,
+               "The PHY clock can't keep the same rate on the slow clock");
+
+// Extra targets that can be shared out between the buttons.
+#define MAX_EXTRA_TARGETS (8)
+
+// What an erased rampTime and rampInterval mean.
+#define DIM_RAMP_TIME_DEFAULT       (50)
+#define DIM_RAMP_INTERVAL_DEFAULT   (160)
+// Longest rampInterval we'll use.  A step can go out late by a settling time or two, waiting for the bus, and still
+// has to make the DAPC sequence.
+#define DIM_RAMP_INTERVAL_MAX       (DALI_DAPC_SEQUENCE_MS - 40)
+
 typedef struct {
     uint8_t numButtons;
     uint8_t targets[5]; // The targets
@@ -23,10 +89,80 @@ typedef struct {
     uint16_t shortPressTimer; // in ms
     uint16_t doublePressTimer; 
     uint16_t repeatTimer;  
+
+    // One bit per button.  If set, the button toggles the light as soon as the press is debounced, rather
+    // than when it is released.  A long press then undoes the toggle if it needs to and dims as usual.
+    uint8_t pressActuation;
+
+    // A dali_event_scheme_t.  Unless it's DALI_EVENT_SCHEME_NONE (erased), we're an input device: the buttons are
+    // push button instances, and each gesture is sent as a single event for an application controller to act
+    // on.  targets are unused, and shortPressTimer is how long to wait for the second press of a double press
+    // (0 to not report them).
+    uint8_t eventScheme;
+    // Short address, device group or instance group, depending on the scheme.
+    uint8_t eventAddress;
+    // Instance number of the first button.  The rest follow on.
+    uint8_t firstInstance;
+
+    // Commands for a button go to its target plus any of these with its bit set in extraTargetButtons (bit j for
+    // extraTargets[j]), so one button can light a room.  Queries only go to its target.  Erased (0xFF) entries
+    // aren't used.  Groups (and broadcast) are sent first, and then only the short addresses that we've learnt
+    // aren't in one of the groups, so a set that matches a group is a single frame.
+    uint8_t extraTargets[MAX_EXTRA_TARGETS];
+    uint8_t extraTargetButtons[5];
+
+    // A long press dims along the curve in dim.c, with a DAPC frame every rampInterval ms, taking rampTime (in
+    // tenths of a second) to get from the gear's minimum to its maximum.  Erased (0xFF) is the default.  The steps
+    // are a DAPC sequence, so rampInterval is held to DIM_RAMP_INTERVAL_MAX.
+    uint8_t rampTime;
+    uint8_t rampInterval;
 } config_t;
 
+_Static_assert(sizeof(config_t) <= 32, "config_t doesn't fit in the user row");
+
 
 // Our config is stored in the USERROW of EEPROM
 #define config ((config_t *) &USERROW)
 
+
+// What we have learnt about the control gear of a target.  Min/max levels and fade rate are as set in the gear.
+typedef struct {
+    uint8_t minLevel;
+    uint8_t maxLevel;
+    uint8_t physicalMinLevel;
+    uint8_t fadeRate;
+} gear_info_t;
+
+// minLevel of a gear_info_t we haven't learnt (or have stopped trusting).  Erased EEPROM reads as this.
+#define GEAR_INFO_UNKNOWN   (0xFF)
+// minLevel of a gear_info_t when nothing (or more than one gear) answered, which no gear can have.  Not asked
+// again until the gear answers a level query.
+#define GEAR_INFO_ABSENT    (0x00)
+
+// Things the firmware learns and keeps itself go in the main EEPROM, so that they can't damage the config.
+// Target slots: config->targets, then config->extraTargets.
+#define NUM_TARGET_SLOTS (5 + MAX_EXTRA_TARGETS)
+
+// Groups of a target we haven't learnt.  Erased EEPROM reads as this.  Gear that doesn't answer is kept as in no
+// groups, so that it gets its own frame without being asked every time.
+#define GROUPS_UNKNOWN (0xFFFF)
+
+typedef struct {
+    // CRC-8 of the target slots' addresses when gear and targetGroups were learnt.  They're by slot, so if the
+    // config's targets change, they're all forgotten.  There isn't the room for an address in every entry.
+    uint8_t targetsCheck;
+    // Indexed the same as config->targets
+    gear_info_t gear[5];
+    // Group membership of the gear at each target slot, if it's a short address, and the button it belongs to
+    // has a group to send to.  Asked again, a slot at a time, as cached light levels go stale.
+    uint16_t targetGroups[NUM_TARGET_SLOTS];
+    // Checkpoint of the lifetime counters.
+    perf_t perf;
+} eeprom_t;
+
+// The bootloader keeps the state of an update at the end.
+_Static_assert(sizeof(eeprom_t) <= UPDATE_STATE_OFFSET, "eeprom_t doesn't fit in the EEPROM");
+
+#define eeprom ((const eeprom_t *) hal_eeprom)
+
 #endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include <inttypes.h>
+#include "dim.h"
+
+// The curve steps evenly through CIE 1976 lightness (L*), from the dimmest arc power level to full, and gives the
+// arc power level of each step on the IEC 62386-102 logarithmic curve, where level n is 10^((n-1)/(253/3)-1)
+// percent of full light.  That's 0.1% at level 1.  The arithmetic is all constant, so the compiler works the table
+// out, and only the bytes end up in flash.  Levels in between steps are interpolated, which is close enough.
+
+#define CUBE(x) ((x) * (x) * (x))
+// L* to relative luminance (0 to 1).  L* is linear at the very bottom.
+#define LSTAR_TO_Y(l) ((l) <= 8.0 ? (l) / 903.3 : CUBE(((l) + 16.0) / 116.0))
+#define Y_TO_ARC(y) (1.0 + 253.0 / 3.0 * (__builtin_log10((y) * 100.0) + 1.0))
+// L* of level 1.
+#define LSTAR_MIN (0.001 * 903.3)
+#define CURVE_LEVEL(i) ((uint8_t) (Y_TO_ARC(LSTAR_TO_Y(LSTAR_MIN + (100.0 - LSTAR_MIN) * (i) / DIM_CURVE_STEPS)) + 0.5))
+#define CURVE_4(i) CURVE_LEVEL(i), CURVE_LEVEL(i + 1), CURVE_LEVEL(i + 2), CURVE_LEVEL(i + 3)
+
+static const uint8_t curve[DIM_CURVE_STEPS + 1] = {
+    CURVE_4(0), CURVE_4(4), CURVE_4(8), CURVE_4(12), CURVE_4(16), CURVE_4(20), CURVE_4(24), CURVE_4(28),
+    CURVE_LEVEL(32),
+};
+
+_Static_assert(DIM_CURVE_STEPS == 32, "curve[] is written out for 32 steps");
+
+
+uint8_t dim_level(uint16_t pos) {
+    if (pos >= DIM_POSITION_MAX) {
+        return curve[DIM_CURVE_STEPS];
+    }
+    uint8_t i = pos >> 8;
+    uint8_t frac = pos & 0xFF;
+    return curve[i] + (uint8_t) (((uint16_t) (curve[i + 1] - curve[i]) * frac + 128) >> 8);
+}
+
+
+uint16_t dim_position(uint8_t level) {
+    uint8_t i = 0;
+    while (i < DIM_CURVE_STEPS - 1 && curve[i + 1] <= level) {
+        i++;
+    }
+    if (level >= curve[i + 1]) {
+        return DIM_POSITION_MAX;
+    }
+    if (level <= curve[i]) {
+        return (uint16_t) i << 8;
+    }
+    return ((uint16_t) i << 8) + (uint16_t) (level - curve[i]) * 256 / (curve[i + 1] - curve[i]);
+}
@@ -0,0 +1,17 @@
+#ifndef __DIM_H__
+#define __DIM_H__
+
+#include <inttypes.h>
+
+// Dimming curve.  A position along it (8.8 fixed point, 0 to DIM_CURVE_STEPS << 8) moves the light in equal steps
+// of perceived brightness, so a ramp that moves the position at a steady rate looks steady all the way down.
+#define DIM_CURVE_STEPS (32)
+#define DIM_POSITION_MAX ((uint16_t) DIM_CURVE_STEPS << 8)
+
+// Arc power level at a position, from 1 to 254.
+uint8_t dim_level(uint16_t pos);
+
+// Position of an arc power level (the inverse of dim_level(), as near as the curve allows).
+uint16_t dim_position(uint8_t level);
+
+#endif
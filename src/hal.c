@@ -0,0 +1,443 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include "config.h"
+#include "hal.h"
+#include "nfc.h"
+
+// AVR implementation of the parts of the HAL that aren't simple register accesses.
+// The host build replaces this file with the simulated peripherals in sim/.
+
+typedef enum {
+    PHY_IDLE,
+    PHY_TX,
+    PHY_RX,
+    PHY_WAIT,
+} phy_state_t;
+
+// What TCA0 is currently being used for.  Cleared by the ISRs once the transaction is over.
+// While idle, TCA0 is the PHY clock, counting up from the end of the last frame until PHY_CLOCK_MAX_USEC.
+static volatile phy_state_t phy_state = PHY_IDLE;
+
+// PHY clock ticks between the end of the last frame and the PHY clock being (re)started.
+static volatile uint16_t frame_end_offset;
+
+// Frame currently being clocked out by the TCA0 overflow ISR.  It is left aligned, so the
+// bit being sent is always the MSB.
+static volatile uint32_t tx_frame;
+// Number of overflows still to come before the line is released.  Every overflow bar the last starts a half bit.
+static volatile uint8_t tx_half_bits;
+// What the next overflow toggles the output by (0 or PORT_INT2_bm), to start its half bit or release the line.
+static volatile uint8_t tx_toggle;
+// Set if the bus didn't read back as what we were sending.
+static volatile bool tx_collision;
+// Set if the bus changed while we were waiting and listening.
+static volatile bool bus_active;
+
+// Where TCB0 capture timestamps of every edge seen on AC0 are stored while receiving.
+static uint16_t * volatile rx_edges;
+static volatile uint8_t rx_edge_count;
+static uint16_t rx_timeout;
+
+
+// RTC time we went to sleep with the PHY clock running.
+static uint16_t sleep_rtc;
+static bool clock_suspended;
+
+
+// Prescaler settings, and TCA0 prescalers, for a division of the 20MHz oscillator.  0xFF if there isn't one.
+#define MCLK_PDIV_GC(d) ((d) == 2 ? CLKCTRL_PDIV_2X_gc : (d) == 4 ? CLKCTRL_PDIV_4X_gc : (d) == 8 ? CLKCTRL_PDIV_8X_gc : \
+                         (d) == 16 ? CLKCTRL_PDIV_16X_gc : (d) == 32 ? CLKCTRL_PDIV_32X_gc : (d) == 64 ? CLKCTRL_PDIV_64X_gc : \
+                         (d) == 6 ? CLKCTRL_PDIV_6X_gc : (d) == 10 ? CLKCTRL_PDIV_10X_gc : (d) == 12 ? CLKCTRL_PDIV_12X_gc : \
+                         (d) == 24 ? CLKCTRL_PDIV_24X_gc : (d) == 48 ? CLKCTRL_PDIV_48X_gc : 0xFF)
+#define TCA_CLKSEL_GC(d) ((d) == 1 ? TCA_SINGLE_CLKSEL_DIV1_gc : (d) == 2 ? TCA_SINGLE_CLKSEL_DIV2_gc : \
+                          (d) == 4 ? TCA_SINGLE_CLKSEL_DIV4_gc : (d) == 8 ? TCA_SINGLE_CLKSEL_DIV8_gc : \
+                          (d) == 16 ? TCA_SINGLE_CLKSEL_DIV16_gc : (d) == 64 ? TCA_SINGLE_CLKSEL_DIV64_gc : \
+                          (d) == 256 ? TCA_SINGLE_CLKSEL_DIV256_gc : (d) == 1024 ? TCA_SINGLE_CLKSEL_DIV1024_gc : 0xFF)
+
+typedef struct {
+    // CLKCTRL.MCLKCTRLB
+    uint8_t prescaler;
+    // TCA0 clock select that keeps the PHY clock at PHY_CLOCK_DIV ticks of F_CPU.
+    uint8_t phy_clksel;
+} clock_setting_t;
+
+// The fast clock is F_CPU, which everything timed in CPU ticks assumes.
+static const clock_setting_t clock_fast = { MCLK_PDIV_GC(CLOCK_FAST_DIV) | CLKCTRL_PEN_bm, TCA_CLKSEL_GC(PHY_CLOCK_DIV) };
+static const clock_setting_t clock_slow = { MCLK_PDIV_GC(CLOCK_SLOW_DIV) | CLKCTRL_PEN_bm, TCA_CLKSEL_GC(PHY_CLOCK_SLOW_DIV) };
+_Static_assert(MCLK_PDIV_GC(CLOCK_FAST_DIV) != 0xFF && MCLK_PDIV_GC(CLOCK_SLOW_DIV) != 0xFF, "Not a main clock prescaler setting");
+_Static_assert(TCA_CLKSEL_GC(PHY_CLOCK_DIV) != 0xFF && TCA_CLKSEL_GC(PHY_CLOCK_SLOW_DIV) != 0xFF, "Not a TCA0 prescaler setting");
+
+// TCA0 clock select for the PHY clock at the current main clock.
+static volatile uint8_t phy_clksel;
+
+// Switching the prescaler takes effect straight away.  If TCA0 is the PHY clock (or timing a wait) it keeps
+// going, with its prescaler changed to match, so it doesn't lose track of the bus.
+static void set_clock(const clock_setting_t *clock) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, clock->prescaler);
+        phy_clksel = clock->phy_clksel;
+        if (phy_state != PHY_TX && phy_state != PHY_RX && (TCA0.SINGLE.CTRLA & TCA_SINGLE_ENABLE_bm)) {
+            TCA0.SINGLE.CTRLA = clock->phy_clksel | TCA_SINGLE_ENABLE_bm;
+        }
+    }
+}
+
+
+static inline void set_wdt(uint8_t val) {
+    while (WDT.STATUS & WDT_SYNCBUSY_bm) {
+        ;
+    }
+    CCP = CCP_IOREG_gc;
+    WDT.CTRLA = val;
+}
+
+// The longest WDT period we can set.
+void hal_wdt_enable(bool enable) {
+    set_wdt(enable ? WDT_PERIOD_8KCLK_gc : WDT_PERIOD_OFF_gc);
+}
+
+
+void hal_init() {
+    hal_wdt_enable(true);
+    set_clock(&clock_fast);
+
+    // The half bits are only as even as the latency of the TCA0 interrupt, which mustn't wait behind the buttons.
+    CPUINT.LVL1VEC = TCA0_OVF_vect_num;
+
+    // Set the DALI output (PB2) as an output, initially set to zero out (not shorted)
+    PORTB.OUTCLR = PORT_INT2_bm;
+    PORTB.DIRSET = PORT_INT2_bm;
+
+    // Set up the DALI input (PA7) using the Analog Comparator with reference of 0.55V
+    // This makes it trigger sooner than if we were doing digital I/O, as it has a much lower threshold
+    // The AC is left off until the first transaction (phy_power_up()), and the reference only runs while it asks for it.
+    VREF.CTRLA = VREF_DAC0REFSEL_0V55_gc;
+    PORTA.PIN7CTRL  = PORT_ISC_INPUT_DISABLE_gc; // Disable Digital I/O, so that it doesn't mess with the impedence
+    AC0.MUXCTRLA = AC_MUXNEG_VREF_gc | AC_MUXPOS_PIN0_gc;
+
+    // Route the AC output to TCB0 through the event system, so that it can timestamp the edges of backward frames
+    EVSYS.ASYNCCH0 = EVSYS_ASYNCCH0_AC0_OUT_gc;
+    EVSYS.ASYNCUSER0 = EVSYS_ASYNCUSER0_ASYNCCH0_gc;
+    TCB0.CTRLB = TCB_CNTMODE_CAPT_gc;
+
+    // Turn on the RTC.  The watchdog is off whenever we might sleep for longer than it lasts.
+    RTC.CLKSEL = RTC_CLKSEL_INT1K_gc; // Slow down buddy.
+    while (RTC.STATUS & RTC_CTRLABUSY_bm) {
+        ;
+    }
+    // Keep counting in standby, for the button timeouts.
+    RTC.CTRLA = RTC_RTCEN_bm | RTC_RUNSTDBY_bm | RTC_PRESCALER_DIV1_gc;
+    // And the PIT for debouncing, with its interrupt off until there's something to sample (hal_sample_timer()).
+    while (RTC.PITSTATUS & RTC_CTRLBUSY_bm) {
+        ;
+    }
+    RTC.PITCTRLA = RTC_PERIOD_CYC2_gc | RTC_PITEN_bm;
+
+#ifdef TRACE
+    // 115200 8N1 out of PA1, for the trace.  Only ever used at the fast clock.
+    PORTMUX.CTRLB = PORTMUX_USART0_bm;
+    PORTA.OUTSET = PIN1_bm;
+    PORTA.DIRSET = PIN1_bm;
+    USART0.BAUD = (uint16_t) (F_CPU * 64.0 / (16 * 115200.0) + 0.5);
+    USART0.CTRLC = USART_CMODE_ASYNCHRONOUS_gc | USART_PMODE_DISABLED_gc | USART_CHSIZE_8BIT_gc | USART_SBMODE_1BIT_gc;
+    USART0.CTRLB = USART_TXEN_bm;
+#endif
+}
+
+
+void hal_eeprom_write(uint8_t offset, const void *data, uint8_t len) {
+    const uint8_t *src = data;
+    while (len) {
+        while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm) {
+            ;
+        }
+        // Fill the page buffer with whatever has changed up to the end of this page, then erase and write just
+        // the bytes we filled.  A page with nothing changed isn't written at all.
+        bool changed = false;
+        do {
+            if (hal_eeprom[offset] != *src) {
+                hal_eeprom[offset] = *src;
+                changed = true;
+            }
+            offset++;
+            src++;
+            len--;
+        } while (len && (offset % EEPROM_PAGE_SIZE));
+        if (changed) {
+            CCP = CCP_SPM_gc;
+            NVMCTRL.CTRLA = NVMCTRL_CMD_PAGEERASEWRITE_gc;
+        }
+    }
+}
+
+
+
+// The ST25DV driver is the bootloader's (bootloader/src/nfc.c).  The TWI is only on for as long as this takes.
+bool hal_nfc_publish(const void *data, uint8_t len) {
+    NFC_initHost();
+    uint8_t ctrl;
+    bool ok = NFC_get_dyn(NFC_REG_MB_CTRL_Dyn, &ctrl) && !(ctrl & NFC_MB_CTRL_RF_PUT_MSG_bm);
+    if (ok) {
+        // Turning the mailbox off and on again empties it, if our last message hasn't been read.  The host can
+        // only put a message in an empty one.
+        uint8_t off = 0;
+        uint8_t on = NFC_MB_CTRL_ENABLE_bm;
+        ok = NFC_write(NFC_NO_E2, NFC_REG_MB_CTRL_Dyn, &off, 1) &&
+             NFC_write(NFC_NO_E2, NFC_REG_MB_CTRL_Dyn, &on, 1) &&
+             NFC_write(NFC_NO_E2, NFC_REG_MB_dyn, (uint8_t *) data, len);
+    }
+    TWI0.MCTRLA = 0;
+    return ok;
+}
+
+bool phy_bus_idle() {
+    return AC0.STATUS & AC_STATE_bm;
+}
+
+
+bool phy_power_up() {
+    if (AC0.CTRLA & AC_ENABLE_bm) {
+        return false;
+    }
+    AC0.CTRLA = AC_HYSMODE_OFF_gc | AC_ENABLE_bm;
+    return true;
+}
+
+
+// Start TCA0 counting from zero, overflowing (and interrupting) after period ticks of clksel.
+static inline void start_phy_timer(uint16_t period, uint8_t clksel) {
+    TCA0.SINGLE.CNT = 0;
+    TCA0.SINGLE.PER = period - 1;
+    TCA0.SINGLE.INTFLAGS = TCA_SINGLE_OVF_bm;
+    TCA0.SINGLE.INTCTRL = TCA_SINGLE_OVF_bm;
+    TCA0.SINGLE.CTRLA = clksel | TCA_SINGLE_ENABLE_bm;
+}
+
+static inline void stop_phy_timer() {
+    TCA0.SINGLE.CTRLA = 0;
+    TCA0.SINGLE.INTCTRL = 0;
+}
+
+// Called from the ISRs when a transaction is over, offset PHY clock ticks after the last frame ended.
+// TCA0 carries on as the PHY clock, and stops itself (from the overflow) once it no longer matters.
+static inline void end_transaction(uint16_t offset) {
+    frame_end_offset = offset;
+    start_phy_timer(USEC_TO_PHY_TICKS(PHY_CLOCK_MAX_USEC), phy_clksel);
+    phy_state = PHY_IDLE;
+}
+
+
+// Sleep in IDLE (peripherals still clocked) until the ISRs have finished the current transaction.
+// Interrupts are disabled around the check so that the final ISR can't slip in between
+// checking the state and going to sleep.
+static void wait_for_phy() {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    while (phy_state != PHY_IDLE) {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        cli();
+    }
+    sei();
+}
+
+
+// Every half bit, including the first, is driven from the TCA0 overflow, so the timing comes from the timer
+// rather than from how long our loop takes.  Each level is worked out in the overflow before, so that it goes out
+// the same number of cycles into every interrupt.  That leaves the CPU with nothing to do but the interrupts, so we
+// transmit from the slow clock, where a cycle is 2.4us.
+bool phy_transmit(uint32_t frame, uint8_t nbits) {
+    set_clock(&clock_slow);
+    tx_frame = frame;
+    tx_half_bits = nbits * 2;
+    // The line is released, and the first half bit is the inverse of the first bit.
+    tx_toggle = frame & 0x80000000UL ? PORT_INT2_bm : 0;
+    tx_collision = false;
+    phy_state = PHY_TX;
+    start_phy_timer(TX_HALF_BIT_TICKS, TCA_SINGLE_CLKSEL_DIV1_gc);
+    // Overflow straight away for the first half bit.
+    TCA0.SINGLE.CNT = TX_HALF_BIT_TICKS - 1;
+    wait_for_phy();
+    set_clock(&clock_fast);
+    return !tx_collision;
+}
+
+
+uint8_t phy_receive(uint16_t timeout, uint16_t *edges) {
+    rx_edges = edges;
+    rx_edge_count = 0;
+    rx_timeout = timeout;
+    phy_state = PHY_RX;
+
+    // Capture the falling edge of the start bit first, then alternate.
+    TCB0.EVCTRL = TCB_CAPTEI_bm | TCB_EDGE_bm;
+    TCB0.INTFLAGS = TCB_CAPT_bm;
+    TCB0.INTCTRL = TCB_CAPT_bm;
+    TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+
+    // TCA0 provides the response timeout, and is restarted on each edge to detect the end of the frame.
+    start_phy_timer(timeout, TCA_SINGLE_CLKSEL_DIV1_gc);
+    wait_for_phy();
+
+    TCB0.CTRLA = 0;
+    TCB0.INTCTRL = 0;
+    return rx_edge_count;
+}
+
+
+uint16_t phy_since_frame_end() {
+    uint16_t since = 0xFFFF;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // The clock is only running while the last frame still matters.
+        if (phy_state == PHY_IDLE && (TCA0.SINGLE.CTRLA & TCA_SINGLE_ENABLE_bm)) {
+            since = frame_end_offset + TCA0.SINGLE.CNT;
+        }
+    }
+    return since;
+}
+
+
+// PHY clock ticks per RTC tick.
+#define PHY_TICKS_PER_RTC_TICK ((uint16_t) (F_CPU / PHY_CLOCK_DIV / 1024))
+
+// Called with interrupts off.
+void phy_sleep() {
+    AC0.CTRLA = 0;
+    clock_suspended = phy_state == PHY_IDLE && (TCA0.SINGLE.CTRLA & TCA_SINGLE_ENABLE_bm);
+    sleep_rtc = RTC.CNT;
+}
+
+// TCA0 picks up where it left off, so add on however long we were asleep.  The RTC only ticks every ~1ms and
+// stops altogether in power down, so this rounds down, which errs on the side of waiting longer for the bus.
+void phy_wake() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (clock_suspended) {
+            uint16_t slept = RTC.CNT - sleep_rtc;
+            if (slept > USEC_TO_PHY_TICKS(PHY_CLOCK_MAX_USEC) / PHY_TICKS_PER_RTC_TICK) {
+                stop_phy_timer();
+            } else if (slept) {
+                frame_end_offset += (slept - 1) * PHY_TICKS_PER_RTC_TICK;
+            }
+            clock_suspended = false;
+        }
+    }
+}
+
+
+// Nothing is timed in CPU ticks while we wait, so drop to the slow clock for it.  Listening is the comparator's
+// interrupt, on either edge.
+bool phy_wait(uint16_t ticks, bool listen) {
+    set_clock(&clock_slow);
+    bus_active = false;
+    phy_state = PHY_WAIT;
+    start_phy_timer(ticks, phy_clksel);
+    if (listen) {
+        AC0.STATUS = AC_CMP_bm;
+        AC0.INTCTRL = AC_CMP_bm;
+    }
+    wait_for_phy();
+    AC0.INTCTRL = 0;
+    set_clock(&clock_fast);
+    return !bus_active;
+}
+
+
+// The bus changed while we were waiting for it to settle, so somebody else has started a frame.  Stop waiting.
+ISR(AC0_AC_vect) {
+    AC0.STATUS = AC_CMP_bm;
+    AC0.INTCTRL = 0;
+    if (phy_state == PHY_WAIT) {
+        stop_phy_timer();
+        bus_active = true;
+        phy_state = PHY_IDLE;
+    }
+}
+
+
+// Fires once per half bit while transmitting, as the timeout while receiving, and at the end of a wait
+// or of the PHY clock.
+ISR(TCA0_OVF_vect) {
+    TCA0.SINGLE.INTFLAGS = TCA_SINGLE_OVF_bm;
+    if (phy_state == PHY_TX) {
+        // The line as it was for the half bit that's just finished, then straight out with the next one, which the
+        // last overflow worked out.  Nothing before the write depends on what it is.
+        const uint8_t out = PORTB.OUT;
+        const uint8_t bus = AC0.STATUS;
+        const uint8_t toggle = tx_toggle;
+        PORTB.OUTTGL = toggle;
+
+        uint8_t remaining = tx_half_bits;
+        if (remaining == 0) {
+            // The last half bit (or the break) had been on the bus for its full period, and that was the line
+            // released.  Start timing from here.
+            end_transaction(0);
+            return;
+        }
+        // We'd had the line released for the whole of the half bit that's just finished, so it should have gone
+        // high by then.  If it was low, somebody else is pulling it down.  Hold it low ourselves for a break
+        // instead of the rest of the frame.  The counter has only just wrapped, so the new period applies to this one.
+        if (!(out & PORT_INT2_bm) && !(bus & AC_STATE_bm)) {
+            PORTB.OUTSET = PORT_INT2_bm;
+            TCA0.SINGLE.PER = TX_BREAK_TICKS - 1;
+            tx_collision = true;
+            tx_half_bits = 0;
+            tx_toggle = PORT_INT2_bm;
+            return;
+        }
+        remaining--;
+        tx_half_bits = remaining;
+        const uint8_t level = (out ^ toggle) & PORT_INT2_bm;
+        uint8_t next;
+        if (remaining == 0) {
+            next = 0;
+        } else if (remaining & 1) {
+            // Second half of a bit is always a transition.
+            next = level ^ PORT_INT2_bm;
+        } else {
+            // First half of a Manchester bit is the inverse of its value on the bus, which is our output level.
+            uint32_t frame = tx_frame << 1;
+            tx_frame = frame;
+            next = frame & 0x80000000UL ? PORT_INT2_bm : 0;
+        }
+        tx_toggle = level ^ next;
+        return;
+    }
+    if (phy_state == PHY_RX) {
+        // Either nothing turned up within the response window (so the last frame was the one we sent,
+        // just before we started listening), or the line has been quiet for long enough that the frame
+        // must be over, which was 2 bit periods after its last edge.
+        end_transaction(rx_edge_count ? USEC_TO_PHY_TICKS(DALI_BIT_USECS * 2) : rx_timeout / PHY_CLOCK_DIV);
+        return;
+    }
+    stop_phy_timer();
+    phy_state = PHY_IDLE;
+}
+
+
+// AC0 output is routed to TCB0 through the event system, so the counter value at every edge is
+// captured in hardware.  All we need to do here is store it and look for the opposite edge next.
+ISR(TCB0_INT_vect) {
+    // Reading CCMP clears the capture flag.
+    uint16_t t = TCB0.CCMP;
+    TCB0.EVCTRL ^= TCB_EDGE_bm;
+
+    uint8_t n = rx_edge_count;
+    if (n < PHY_MAX_EDGES) {
+        rx_edges[n] = t;
+    }
+    // Count one past the end so that an overflow can be reported as a collision.
+    if (n <= PHY_MAX_EDGES) {
+        rx_edge_count = n + 1;
+    }
+
+    // Frame is over once the line has been quiet for 2 bit periods.  The TCA0 overflow is high priority, so can
+    // end the frame in between, and then TCA0 is the PHY clock, which mustn't be touched.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (phy_state == PHY_RX) {
+            TCA0.SINGLE.CNT = 0;
+            TCA0.SINGLE.PER = USEC_TO_TICKS(DALI_BIT_USECS * 2) - 1;
+        }
+    }
+}
@@ -0,0 +1,212 @@
+#ifndef __HAL_H__
+#define __HAL_H__
+
+// Thin hardware access layer.  Everything that touches a peripheral register goes through here, so that
+// the rest of the firmware can also be built for the host against the simulated peripherals in sim/.
+// On the AVR the accessors are inline register accesses, so they cost nothing over using the registers directly.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef HOST_SIM
+#include "hal_sim.h"
+#else
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+#include <util/atomic.h>
+
+// For test board, switches are on PORTA
+#define SWITCH_PORT PORTA
+
+static inline uint16_t hal_rtc_now() {
+    return RTC.CNT;
+}
+
+static inline uint8_t hal_switch_read() {
+    return SWITCH_PORT.IN;
+}
+
+// Set up pins with pullup, with no interrupt.  the interrupt will be turned on while sleeping.
+static inline void hal_switch_init(uint8_t mask) {
+    for (uint8_t pin = 0; pin < 8; pin++) {
+        if (mask & (1 << pin)) {
+            (&SWITCH_PORT.PIN0CTRL)[pin] = PORT_PULLUPEN_bm;
+        }
+    }
+    SWITCH_PORT.DIRCLR = mask;
+}
+
+// What makes a switch pin interrupt.  While the buttons are being sampled, nothing.  Otherwise any change, as both
+// edges is one of the two senses that work on every pin with the clocks stopped.  In power down, a low level (the
+// other one), since only a press can get us going again.  It keeps firing for as long as the button is held, so
+// has to be turned off again on wake.
+#define SWITCH_SENSE_NONE   PORT_ISC_INTDISABLE_gc
+#define SWITCH_SENSE_CHANGE PORT_ISC_BOTHEDGES_gc
+#define SWITCH_SENSE_WAKE   PORT_ISC_LEVEL_gc
+
+static inline void hal_switch_sense(uint8_t mask, uint8_t sense) {
+    for (uint8_t pin = 0; pin < 8; pin++) {
+        if (mask & (1 << pin)) {
+            (&SWITCH_PORT.PIN0CTRL)[pin] = PORT_PULLUPEN_bm | sense;
+        }
+    }
+}
+
+static inline uint8_t hal_switch_pending() {
+    return SWITCH_PORT.INTFLAGS;
+}
+
+static inline void hal_switch_ack(uint8_t mask) {
+    SWITCH_PORT.INTFLAGS = mask;
+}
+
+// Interrupt (RTC_PIT_vect) every HAL_SAMPLE_TICKS while on, from the PIT.  The PIT itself runs all the time, so this
+// doesn't have to wait for a write to get through to the RTC clock domain, as hal_rtc_alarm() does, and is safe
+// from an ISR.  The first interrupt comes at the next period boundary.
+#define HAL_SAMPLE_TICKS (2)
+
+static inline void hal_sample_timer(bool on) {
+    RTC.PITINTFLAGS = RTC_PI_bm;
+    RTC.PITINTCTRL = on ? RTC_PI_bm : 0;
+}
+
+// Interrupt (RTC_CNT_vect) when the RTC reaches at.  One shot.  Waits for the last write to CMP to get through to
+// the RTC clock domain, which can take a couple of ms, so not for ISRs.
+static inline void hal_rtc_alarm(uint16_t at) {
+    while (RTC.STATUS & RTC_CMPBUSY_bm) {
+        ;
+    }
+    RTC.CMP = at;
+    RTC.INTFLAGS = RTC_CMP_bm;
+    RTC.INTCTRL = RTC_CMP_bm;
+}
+
+static inline void hal_rtc_alarm_off() {
+    RTC.INTCTRL = 0;
+}
+
+// Power down stops everything (even the RTC counter).  Standby keeps the RTC counting, so that its compare can wake us.
+#define SLEEP_DEEP  SLEEP_MODE_PWR_DOWN
+#define SLEEP_TIMED SLEEP_MODE_STANDBY
+
+// Call with interrupts off.  They go back on with the sleep, so an interrupt that comes in between deciding to
+// sleep and sleeping still wakes us.  The DALI driver idles in SLEEP_MODE_IDLE, so the mode is set each time.
+static inline void hal_sleep(uint8_t mode) {
+    set_sleep_mode(mode);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
+
+// EEPROM is memory mapped, so it reads like RAM.  Writes have to go through hal_eeprom_write().
+#define hal_eeprom ((volatile uint8_t *) EEPROM_START)
+
+static inline void hal_reset() {
+    // Write a bit into the SWRR to reboot the device (to the bootloader).
+    RSTCTRL.SWRR = RSTCTRL_SWRE_bm;
+}
+
+// What caused the last reset, as RSTCTRL.RSTFR flags.  They're cleared, so this only answers once.
+#define HAL_RESET_WATCHDOG RSTCTRL_WDRF_bm
+// The reset pin, which is where the tag could have reset us from.
+#define HAL_RESET_EXTERNAL RSTCTRL_EXTRF_bm
+
+static inline uint8_t hal_reset_cause() {
+    uint8_t flags = RSTCTRL.RSTFR;
+    RSTCTRL.RSTFR = flags;
+    return flags;
+}
+
+#ifdef TRACE
+// Transmit only, for the trace.  USART0 is on its alternate pins (TX on PA1), the same as the bootloader's console.
+static inline void hal_uart_putc(char c) {
+    while (!(USART0.STATUS & USART_DREIF_bm)) {
+        ;
+    }
+    USART0.TXDATAL = c;
+}
+
+// Wait for the last byte to have gone out.
+static inline void hal_uart_drain() {
+    while (!(USART0.STATUS & USART_TXCIF_bm)) {
+        ;
+    }
+    USART0.STATUS = USART_TXCIF_bm;
+}
+#endif
+
+// Differs from one device to the next (it's made from the serial number), for seeding random numbers.
+static inline uint16_t hal_seed() {
+    uint16_t seed = 0;
+    for (uint8_t i = 0; i < 10; i++) {
+        seed = seed * 31 + (&SIGROW.SERNUM0)[i];
+    }
+    return seed;
+}
+#endif
+
+
+// The watchdog is on while we're awake, and off for sleeps that could outlast its 8 second period.
+void hal_wdt_enable(bool enable);
+
+// Write len bytes to EEPROM at offset.  Only the bytes that differ from what's there are erased and written, so
+// rewriting a block wears only the bytes that changed.  Returns without waiting for the last page to finish
+// writing (about 4ms), so don't read back what was just written straight away.
+void hal_eeprom_write(uint8_t offset, const void *data, uint8_t len);
+
+// Put a message in the ST25DV's mailbox, for the RF side (a phone) to read, replacing any of ours still
+// there.  Leaves alone a message from the RF side, which is for the bootloader.  Returns false if the tag
+// isn't there, or the mailbox isn't ours to use.  About 5ms for 64 bytes.
+bool hal_nfc_publish(const void *data, uint8_t len);
+
+// A backward frame is a start bit plus 8 bits, so has at most 18 edges.  Anything more is
+// more than one device talking.
+#define PHY_MAX_EDGES (18)
+
+// One off set up of the clock, watchdog, DALI I/O and RTC
+void hal_init();
+
+// Send nbits (including the start bit) of a left aligned, pre-encoded frame.  Returns once it is on the bus.
+// The bus is read back at the end of every half bit we leave it high.  If it's low, somebody else is transmitting
+// too, so we stop, hold the bus low for DALI_BREAK_USEC so that they notice as well, and return false.  The PHY clock
+// starts at the end of the break.
+bool phy_transmit(uint32_t frame, uint8_t nbits);
+
+// Capture the edges of a backward frame that starts within timeout CPU ticks, as CPU tick timestamps.
+// Edges alternate, starting with falling.  Returns the number of edges seen, which will be one more
+// than PHY_MAX_EDGES if there were too many to store.
+uint8_t phy_receive(uint16_t timeout, uint16_t *edges);
+
+// true if the bus is currently at its idle (high) level.
+bool phy_bus_idle();
+
+// The comparator on the bus input, and the 0.55V reference it uses, draw far more than the rest of the chip does
+// asleep, so they are only on from the first transaction after waking until we next sleep.  phy_power_up() returns
+// true if they were off, in which case they take PHY_POWER_UP_USEC before the PHY can be used.
+#define PHY_POWER_UP_USEC   (25)
+bool phy_power_up();
+
+// Called around any sleep deeper than idle.  Turns the comparator off, and keeps the PHY clock (which stops with
+// the CPU clock) going with the RTC.
+void phy_sleep();
+void phy_wake();
+
+// The PHY keeps a clock running from the end of the last frame on the bus (the one we sent, or the last edge
+// we received), so that the next frame can go out as soon as the bus timing allows.  It counts in units of
+// PHY_CLOCK_DIV CPU ticks, and stops once PHY_CLOCK_MAX_USEC have gone by, which is longer than any settling time.
+#define PHY_CLOCK_DIV       (64)
+#define PHY_CLOCK_MAX_USEC  (50000)
+
+// PHY clock ticks since the last frame ended, or 0xFFFF if it is long enough ago not to matter.
+uint16_t phy_since_frame_end();
+
+// Sleep (with the peripherals running) for ticks PHY clock ticks.  The CPU runs at F_CPU other than in here and in
+// phy_transmit(), where it drops to CLOCK_SLOW_DIV.  If listen is set (the comparator has to be up already), the wait
+// ends early, returning false, if the bus changes.
+bool phy_wait(uint16_t ticks, bool listen);
+
+#endif
@@ -0,0 +1,56 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "config.h"
+#include "hal.h"
+#include "perf.h"
+
+// Pin wake ups (a press or a release, more or less) between checkpoints.  Only the bytes that have changed are
+// written, which is mostly the bottom byte or two of each counter, so at a few hundred presses a day those see a
+// few thousand writes a year, against the EEPROM's 100k.
+#define PERF_CHECKPOINT_WAKEUPS (64)
+
+perf_t perf;
+
+// perf.wakeups[PERF_WAKE_PIN] at the last checkpoint.
+static uint32_t checkpointed;
+
+// Whether the counters go in the mailbox at the next perf_idle(), whether or not it's a checkpoint.
+static bool publish;
+
+
+void perf_init() {
+    if (eeprom->perf.version == PERF_VERSION) {
+        memcpy(&perf, (const void *) &eeprom->perf, sizeof(perf));
+    }
+    perf.version = PERF_VERSION;
+    perf.wakeups[PERF_WAKE_RESET]++;
+    uint8_t cause = hal_reset_cause();
+    if (cause & HAL_RESET_WATCHDOG) {
+        perf.watchdog_resets++;
+    }
+    checkpointed = perf.wakeups[PERF_WAKE_PIN];
+    // Not saved until the next checkpoint, so that a reset loop doesn't wear out the EEPROM.  If a phone could have
+    // reset us it's probably after the counters, but it can wait until we're idle for them, rather than have every
+    // boot pay for the I2C.
+    publish = cause & HAL_RESET_EXTERNAL;
+}
+
+
+// Runs with interrupts on, and the wake up counts go up in interrupts, so it works from a copy.
+void perf_idle() {
+    perf_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = perf;
+    }
+    if (now.wakeups[PERF_WAKE_PIN] - checkpointed >= PERF_CHECKPOINT_WAKEUPS) {
+        hal_eeprom_write(offsetof(eeprom_t, perf), &now, sizeof(now));
+        checkpointed = now.wakeups[PERF_WAKE_PIN];
+        publish = true;
+    }
+    if (publish) {
+        hal_nfc_publish(&now, sizeof(now));
+        publish = false;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include "cmd.h"
+
+// Lifetime counters, for finding the switches that are awake too much or struggle on the bus, without a console.
+// They're kept in RAM, checkpointed to EEPROM every so often (while nothing else is going on), and put in the
+// ST25DV's mailbox at the same time, where a phone can read them (ST25 app, read mailbox).
+//
+// Anything since the last checkpoint is lost on a reset, including a reset that keeps happening before we get
+// to one.  The mailbox message is the perf_t below, little endian with no padding.
+
+// Version of perf_t.  Anything else in EEPROM (e.g. erased) starts the counts from zero.
+#define PERF_VERSION (1)
+
+// What woke us up.  Timed wake ups are the RTC compare, or the PIT while debouncing.
+typedef enum {
+    PERF_WAKE_PIN,
+    PERF_WAKE_RTC,
+    PERF_WAKE_RESET,
+    PERF_WAKE_SOURCES,
+} perf_wake_t;
+
+typedef struct {
+    uint32_t wakeups[PERF_WAKE_SOURCES];
+    // RTC ticks (1024 a second) awake, and asleep in standby.  The RTC stops while we're powered down, so that
+    // doesn't count as either.
+    uint32_t awake_ticks;
+    uint32_t sleep_ticks;
+    dali_stats_t dali;
+    uint16_t watchdog_resets;
+    uint8_t version;
+} perf_t;
+
+extern perf_t perf;
+
+// Restore the counters from EEPROM, and count the reset.
+void perf_init();
+
+// Call when none of the buttons has anything to do.  Checkpoints the counters if it's been long enough, and puts
+// them in the mailbox then, or the first time after a reset from the tag.
+void perf_idle();
+
+#endif
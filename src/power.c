@@ -0,0 +1,51 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include "hal.h"
+#include "perf.h"
+#include "power.h"
+#include "trace.h"
+
+// Sleep governor.
+//
+//   sleep       mode        RTC     watchdog    comparator + reference
+//   POWER_DOZE  standby     on      on          off
+//   POWER_WAIT  standby     on      off         off
+//   POWER_OFF   power down  off     off         off
+//
+// Nothing wakes us periodically.  The watchdog is only there to catch us getting stuck while awake, so it is
+// turned off for any sleep that could outlast it rather than having the PIT wake us up to reset it.  The DALI
+// driver does its own sleeping (in idle) while a transaction is in progress.
+
+// Set while we're asleep, so that whichever interrupt wakes us can be counted.
+static volatile bool sleeping;
+// RTC time we last woke up.
+static uint16_t woke;
+
+
+void power_sleep(power_sleep_t sleep) {
+    TRACE_POINT(TRACE_SLEEP, sleep);
+    uint16_t now = hal_rtc_now();
+    perf.awake_ticks += (uint16_t) (now - woke);
+    phy_sleep();
+    if (sleep != POWER_DOZE) {
+        hal_wdt_enable(false);
+    }
+    sleeping = true;
+    hal_sleep(sleep == POWER_OFF ? SLEEP_DEEP : SLEEP_TIMED);
+    sleeping = false;
+    if (sleep != POWER_DOZE) {
+        hal_wdt_enable(true);
+    }
+    phy_wake();
+    woke = hal_rtc_now();
+    perf.sleep_ticks += (uint16_t) (woke - now);
+    TRACE_POINT(TRACE_WAKE, 0);
+}
+
+
+void power_woken(perf_wake_t source) {
+    if (sleeping) {
+        sleeping = false;
+        perf.wakeups[source]++;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef __POWER_H__
+#define __POWER_H__
+
+#include "perf.h"
+
+// What a sleep has to allow for.  The governor picks the deepest sleep mode that does, and turns off whatever
+// else it can for the duration.
+typedef enum {
+    // Woken by the RTC compare (within a second or so) or a pin.  The watchdog keeps running.
+    POWER_DOZE,
+    // Woken by the RTC compare or a pin, possibly after longer than the watchdog period.
+    POWER_WAIT,
+    // Only a pin can wake us.
+    POWER_OFF,
+} power_sleep_t;
+
+// Call with interrupts off, and whatever is going to wake us already set up.  Returns with interrupts on.
+void power_sleep(power_sleep_t sleep);
+
+// For interrupt handlers to say what they are.  If it's the one that woke us, it's counted.
+void power_woken(perf_wake_t source);
+
+#endif
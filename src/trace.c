@@ -0,0 +1,83 @@
+#ifdef TRACE
+#include <inttypes.h>
+#include <stdbool.h>
+#include "hal.h"
+#include "trace.h"
+
+// Entries kept between flushes.  Power of 2.  There's only 512 bytes of RAM, so a long press outruns it, in which
+// case the oldest are lost (and counted).
+#ifndef TRACE_SIZE
+#define TRACE_SIZE (32)
+#endif
+
+typedef struct {
+    uint16_t at;
+    uint8_t event;
+    uint8_t arg;
+} trace_entry_t;
+
+// Both count up forever, and wrap.  16 bits, so that a long gap between flushes can't lap them and look short.
+static trace_entry_t ring[TRACE_SIZE];
+static uint16_t head;
+static uint16_t flushed;
+
+
+// Called from the pin and RTC interrupts as well.
+void trace_point(trace_event_t event, uint8_t arg) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        trace_entry_t *e = &ring[head++ & (TRACE_SIZE - 1)];
+        e->at = hal_rtc_now();
+        e->event = event;
+        e->arg = arg;
+    }
+}
+
+
+static void put_hex(uint8_t b) {
+    static const char digits[] = "0123456789ABCDEF";
+    hal_uart_putc(digits[b >> 4]);
+    hal_uart_putc(digits[b & 0x0F]);
+}
+
+// Everything since the last flush, as one line: "T", how many entries were overwritten before we got to them
+// (up to FF), then the RTC time, event and arg of each, all in hex.  At 115200 baud a full ring takes about 25ms,
+// which is why it's only done once every button is idle, and with interrupts on.  If they lap the ring meanwhile,
+// the line stops short and the rest goes out (as lost) with the next one.
+void trace_flush() {
+    uint16_t end;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        end = head;
+    }
+    if (flushed == end) {
+        return;
+    }
+    uint8_t lost = 0;
+    if ((uint16_t) (end - flushed) > TRACE_SIZE) {
+        uint16_t overwritten = end - flushed - TRACE_SIZE;
+        lost = overwritten > 0xFF ? 0xFF : overwritten;
+        flushed = end - TRACE_SIZE;
+    }
+    hal_uart_putc('T');
+    hal_uart_putc(' ');
+    put_hex(lost);
+    for (; flushed != end; flushed++) {
+        trace_entry_t e;
+        bool lapped;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            lapped = (uint16_t) (head - flushed) > TRACE_SIZE;
+            e = ring[flushed & (TRACE_SIZE - 1)];
+        }
+        if (lapped) {
+            break;
+        }
+        hal_uart_putc(' ');
+        put_hex(e.at >> 8);
+        put_hex(e.at);
+        put_hex(e.event);
+        put_hex(e.arg);
+    }
+    hal_uart_putc('\n');
+    // Powering down stops the UART's clock, so the last byte has to be out first.
+    hal_uart_drain();
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+// Timing trace, for seeing where the time goes in a gesture (debouncing, waiting for the bus, queries, replies,
+// getting back to sleep).  Only built in with TRACE defined (make TRACE=1).  Otherwise TRACE_POINT() and
+// TRACE_FLUSH() are nothing at all, so a normal build doesn't carry any of it.
+//
+// Each trace point goes into a small ring in RAM, with the RTC time.  Everything since the last flush is sent
+// out of the UART (TX on PA1, as the bootloader's console) as one line once every button is idle, when there's
+// nothing left for it to get in the way of.  trace.py turns that back into a timeline per gesture.
+
+typedef enum {
+    // A button pin interrupt.  arg: the pins that changed.
+    TRACE_PIN,
+    // The debouncer has seen a button change state.  arg: the pin, with 0x80 set for a release.
+    TRACE_INPUT,
+    // A button's state machine moved.  arg: button index << 4 | new state.
+    TRACE_STATE,
+    // A forward frame is ready to go, and we start waiting for the bus.
+    TRACE_WRITE,
+    // The forward frame starts.  arg: how many times it has collided already.
+    TRACE_TX,
+    // Finished with the forward frame.  arg: read_result_t
+    TRACE_WRITE_END,
+    // Waiting for a backward frame.
+    TRACE_READ,
+    // arg: read_result_t
+    TRACE_READ_END,
+    // arg: power_sleep_t
+    TRACE_SLEEP,
+    TRACE_WAKE,
+} trace_event_t;
+
+#ifdef TRACE
+void trace_point(trace_event_t event, uint8_t arg);
+void trace_flush();
+#define TRACE_POINT(event, arg) trace_point(event, arg)
+#define TRACE_FLUSH() trace_flush()
+#else
+#define TRACE_POINT(event, arg) ((void) 0)
+#define TRACE_FLUSH() ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+
+# Decodes the timing trace from a TRACE build of the firmware (see src/trace.h), and prints a timeline for each
+# gesture, along with where its time went.
+#
+#   ./trace.py [-p /dev/ttyUSB0] [file ...]
+#
+# Reads trace lines from the serial port, or from files (or stdin) such as saved console output or dalisim's
+# output.  Lines from dalisim are kept apart by device.
+
+import argparse
+import re
+import sys
+
+RTC_HZ = 1024
+
+PIN, INPUT, STATE, WRITE, TX, WRITE_END, READ, READ_END, SLEEP, WAKE = range(10)
+
+STATES = ['released', 'pressed', 'long held', 'wait for repress']
+RESULTS = ['value', 'nak', 'collision', 'manchester error']
+SLEEPS = ['doze', 'wait', 'off']
+BUTTON_PINS = {0x40: 0, 0x20: 1, 0x10: 2, 0x08: 3, 0x04: 4}
+
+LINE = re.compile(r'(?:dev(\d+)\s+)?T ([0-9A-Fa-f]{2})((?: [0-9A-Fa-f]{8})*)\s*$')
+
+
+def name(names, i):
+    return names[i] if i < len(names) else str(i)
+
+
+def pins(mask):
+    return ' '.join('PA{}'.format(b) for b in range(8) if mask & (1 << b))
+
+
+def describe(event, arg):
+    if event == PIN:
+        return 'pin change {}'.format(pins(arg))
+    if event == INPUT:
+        btn = BUTTON_PINS.get(arg & 0x7F, '?')
+        return 'button {} {}'.format(btn, 'released' if arg & 0x80 else 'pressed')
+    if event == STATE:
+        return 'button {} -> {}'.format(arg >> 4, name(STATES, arg & 0x0F))
+    if event == WRITE:
+        return 'forward frame, waiting for the bus'
+    if event == TX:
+        return 'transmit' + (' (retry {})'.format(arg) if arg else '')
+    if event == WRITE_END:
+        return 'sent' if arg == 1 else 'gave up: ' + name(RESULTS, arg)
+    if event == READ:
+        return 'waiting for a reply'
+    if event == READ_END:
+        return 'reply: ' + name(RESULTS, arg)
+    if event == SLEEP:
+        return 'sleep ({})'.format(name(SLEEPS, arg))
+    if event == WAKE:
+        return 'wake'
+    return 'event {} {:02x}'.format(event, arg)
+
+
+class Device:
+    def __init__(self, id):
+        self.id = id
+        self.time = None
+        self.last_at = 0
+        self.gesture = None
+        self.count = 0
+
+    def add(self, at, event, arg, lost):
+        # RTC ticks wrap at 16 bits.  Powered down the RTC stops, so this is time awake or dozing, not wall time.
+        if self.time is None:
+            self.time = 0
+        else:
+            self.time += (at - self.last_at) & 0xFFFF
+        self.last_at = at
+        ms = self.time * 1000.0 / RTC_HZ
+
+        if self.gesture is None:
+            # The start of a gesture that overran the ring is lost, but what's left is still worth seeing.
+            if event not in (PIN, INPUT) and not lost:
+                return
+            self.count += 1
+            self.gesture = []
+        if lost:
+            self.gesture.append((ms, None, lost))
+        self.gesture.append((ms, event, arg))
+
+    # The firmware only sends the trace once every button is idle, so a gesture is over at the end of a line.
+    def flushed(self):
+        if self.gesture:
+            self.report()
+        self.gesture = None
+
+    def report(self):
+        start = self.gesture[0][0]
+        print('dev{} gesture {}'.format(self.id, self.count))
+        spent = dict(debounce=0.0, holdoff=0.0, transmit=0.0, reply=0.0, asleep=0.0)
+        pin = write = tx = read = sleep = None
+        for ms, event, arg in self.gesture:
+            if event is None:
+                print('  {:8.1f} ms  ({}{} trace entries lost)'.format(ms - start, arg, ' or more' if arg == 0xFF else ''))
+                continue
+            print('  {:8.1f} ms  {}'.format(ms - start, describe(event, arg)))
+            if event == PIN:
+                pin = ms
+            elif event == INPUT and pin is not None:
+                spent['debounce'] += ms - pin
+                pin = None
+            elif event == WRITE:
+                write = ms
+            elif event == TX:
+                tx = ms
+            elif event == WRITE_END and write is not None and tx is not None:
+                spent['holdoff'] += tx - write
+                spent['transmit'] += ms - tx
+                write = tx = None
+            elif event == READ:
+                read = ms
+            elif event == READ_END and read is not None:
+                spent['reply'] += ms - read
+                read = None
+            elif event == SLEEP:
+                sleep = ms
+            elif event == WAKE and sleep is not None:
+                spent['asleep'] += ms - sleep
+                sleep = None
+        end = self.gesture[-1][0]
+        print('  debounce {:.1f} ms, bus hold-off {:.1f} ms, transmitting {:.1f} ms, waiting for replies {:.1f} ms, '
+              'dozing {:.1f} ms, total {:.1f} ms\n'.format(
+                  spent['debounce'], spent['holdoff'], spent['transmit'], spent['reply'], spent['asleep'], end - start))
+
+
+def decode(lines):
+    devices = {}
+    for line in lines:
+        if isinstance(line, bytes):
+            line = line.decode('ascii', 'replace')
+        m = LINE.search(line)
+        if not m:
+            continue
+        id = int(m.group(1) or 0)
+        dev = devices.setdefault(id, Device(id))
+        lost = int(m.group(2), 16)
+        for entry in m.group(3).split():
+            dev.add(int(entry[0:4], 16), int(entry[4:6], 16), int(entry[6:8], 16), lost)
+            lost = 0
+        dev.flushed()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Per gesture timelines from the firmware trace')
+    parser.add_argument('-p', '--port', help='serial port to read from')
+    parser.add_argument('files', nargs='*')
+    args = parser.parse_args()
+    if args.port:
+        import serial
+        with serial.Serial(args.port, 115200) as ser:
+            decode(iter(ser.readline, b''))
+    elif args.files:
+        for path in args.files:
+            with open(path) as f:
+                decode(f)
+    else:
+        decode(sys.stdin)
+
+
+if __name__ == '__main__':
+    main()
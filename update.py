@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+# Streams an application image into the bootloader over NFC, through the ST25DV's fast transfer mode mailbox.
+# Only the pages that differ from what's in the flash (by the CRCs in the bootloader's manifest) are sent, along
+# with any left over from an update that was interrupted.  Pages are packed (see pack.py) when that makes them
+# smaller.  The protocol is in bootloader/src/update.h.
+#
+#   ./update.py blinky/build/main.lz            Or the .hex
+#
+# Talks ISO 15693 to the tag through a PC/SC reader, using its transparent exchange pseudo-APDU.  That part
+# differs between readers, so it's all in exchange().
+
+import argparse
+import sys
+import time
+from smartcard.System import readers
+from pack import PAGE_SIZE, load_image, pack_page
+
+BOOT_SIZE = 0x800
+FLASH_SIZE = 0x2000
+
+UPDATE_MANIFEST = ord('M')
+UPDATE_BEGIN = ord('B')
+UPDATE_WRITE = ord('W')
+UPDATE_PACKED = ord('Z')
+UPDATE_DONE = ord('D')
+UPDATE_ACK = ord('K')
+UPDATE_NAK = ord('N')
+NAK_REASONS = {1: "bad message", 2: "page outside the application", 3: "no update started",
+               4: "pages still to be written", 5: "the image doesn't check out"}
+
+# ST25DV custom commands
+FLAGS = 0x02                # High data rate
+ST_MFG = 0x02
+WRITE_MESSAGE = 0xAA
+READ_MESSAGE_LENGTH = 0xAB
+READ_MESSAGE = 0xAC
+READ_DYN_CONFIG = 0xAD
+MB_CTRL_DYN = 0x0D
+
+MB_EN = 0x01
+HOST_PUT_MSG = 0x02
+RF_PUT_MSG = 0x04
+
+# How long to wait for the bootloader to take a page, or answer, in seconds.
+TIMEOUT = 2.0
+
+
+def crc_ccitt(data, crc=0xFFFF):
+    """As avr-libc's _crc_ccitt_update()"""
+    for b in data:
+        b ^= crc & 0xFF
+        b = (b ^ (b << 4)) & 0xFF
+        crc = ((b << 8) | (crc >> 8)) ^ (b >> 4) ^ (b << 3)
+        crc &= 0xFFFF
+    return crc
+
+
+class Tag:
+    def __init__(self, reader):
+        self.connection = reader.createConnection()
+        self.connection.connect()
+
+    def exchange(self, frame):
+        data, sw1, sw2 = self.connection.transmit([0xFF, 0x00, 0x00, 0x00, len(frame)] + list(frame))
+        if (sw1, sw2) != (0x90, 0x00) or not data or data[0] & 0x01:
+            raise IOError("tag answered {:02x}{:02x} {}".format(sw1, sw2, bytes(data).hex()))
+        return bytes(data[1:])
+
+    def mailbox(self):
+        return self.exchange([FLAGS, READ_DYN_CONFIG, ST_MFG, MB_CTRL_DYN])[0]
+
+    def write_message(self, message):
+        self.exchange([FLAGS, WRITE_MESSAGE, ST_MFG, len(message) - 1] + list(message))
+
+    def read_message(self):
+        length = self.exchange([FLAGS, READ_MESSAGE_LENGTH, ST_MFG])[0] + 1
+        return self.exchange([FLAGS, READ_MESSAGE, ST_MFG, 0x00, length - 1])
+
+    def wait(self, clear=0, put=0):
+        """Waits for the mailbox bits in clear to be clear, and those in put to be set."""
+        end = time.monotonic() + TIMEOUT
+        while time.monotonic() < end:
+            ctrl = self.mailbox()
+            if not ctrl & clear and ctrl & put == put:
+                return ctrl
+        raise TimeoutError("the bootloader isn't answering (mailbox {:02x})".format(ctrl))
+
+
+def send(tag, message):
+    # Our last message has to be gone before there's room for this one.  If the bootloader has something to say
+    # instead, it's a complaint.
+    ctrl = tag.wait(clear=RF_PUT_MSG)
+    if ctrl & HOST_PUT_MSG:
+        reply = tag.read_message()
+        if reply[0] == UPDATE_NAK:
+            raise IOError("bootloader refused a message: {}".format(NAK_REASONS.get(reply[1], reply[1])))
+    tag.write_message(message)
+
+
+def request(tag, message):
+    send(tag, message)
+    tag.wait(put=HOST_PUT_MSG)
+    reply = tag.read_message()
+    if reply[0] == UPDATE_NAK:
+        raise IOError("bootloader refused a message: {}".format(NAK_REASONS.get(reply[1], reply[1])))
+    return reply
+
+
+def manifest(tag):
+    """Returns the CRC of every application page, and the pages an interrupted update still has to write."""
+    reply = request(tag, bytes([UPDATE_MANIFEST, 0]))
+    first, count = reply[1], (FLASH_SIZE - BOOT_SIZE) // PAGE_SIZE
+    crcs = {first + i: reply[2 + i * 2] | (reply[3 + i * 2] << 8) for i in range(count)}
+    bitmap = reply[2 + count * 2:]
+    pending = {first + i for i in range(count) if bitmap[i // 8] & (1 << (i % 8))}
+    return crcs, pending
+
+
+def update(tag, pages):
+    if not tag.mailbox() & MB_EN:
+        sys.exit("The mailbox is off.  Is the bootloader running?")
+    start = time.monotonic()
+    crcs, pending = manifest(tag)
+    if pending:
+        print("{} pages left over from the last update".format(len(pending)))
+    # Pages the image doesn't cover are left as they are.
+    send_pages = sorted(n for n in pages if n in pending or crc_ccitt(pages[n]) != crcs[n])
+    crcs.update({n: crc_ccitt(pages[n]) for n in send_pages})
+    image = crc_ccitt(b"".join(crcs[n].to_bytes(2, "little") for n in sorted(crcs)))
+    bitmap = bytearray(len(crcs) // 8)
+    for n in send_pages:
+        bitmap[(n - min(crcs)) // 8] |= 1 << ((n - min(crcs)) % 8)
+
+    # What's in the flash that packed pages can refer to: the pages that are staying, and those sent already.
+    flash = {n: pages[n] for n in pages if n not in send_pages}
+    air = 0
+    send(tag, bytes([UPDATE_BEGIN, 0]) + image.to_bytes(2, "little") + bitmap)
+    for number in send_pages:
+        packed = pack_page(flash, number, pages[number])
+        if len(packed) < PAGE_SIZE:
+            message = bytes([UPDATE_PACKED, number]) + packed
+        else:
+            message = bytes([UPDATE_WRITE, number]) + pages[number]
+        send(tag, message)
+        air += len(message)
+        flash[number] = pages[number]
+        print("\rpage {:3d}".format(number), end="", flush=True)
+    reply = request(tag, bytes([UPDATE_DONE, 0]))
+    elapsed = time.monotonic() - start
+    if reply[0] != UPDATE_ACK:
+        raise IOError("bootloader didn't finish: {}".format(reply.hex()))
+    print("\r{} of {} pages ({} bytes, {} sent) in {:.2f} s".format(reply[1], len(pages), reply[1] * PAGE_SIZE, air, elapsed))
+    if reply[1] != len(send_pages):
+        raise IOError("sent {} pages, but {} were written".format(len(send_pages), reply[1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Update the application over NFC")
+    parser.add_argument("hex", help="Application image (.hex or .lz), linked at 0x{:x}".format(BOOT_SIZE))
+    parser.add_argument("-r", "--reader", type=int, default=0, help="PC/SC reader number")
+    args = parser.parse_args()
+
+    pages = load_image(args.hex)
+    outside = [n for n in pages if n * PAGE_SIZE < BOOT_SIZE or n * PAGE_SIZE >= FLASH_SIZE]
+    if outside:
+        sys.exit("{} has pages outside the application (is it linked at 0x{:x}?)".format(args.hex, BOOT_SIZE))
+    update(Tag(readers()[args.reader]), pages)
+
+
+if __name__ == "__main__":
+    main()